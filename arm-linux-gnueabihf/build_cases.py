@@ -64,6 +64,28 @@ def build_cases(filename):
                     case["cflags"].append("F_ICASE")
                 elif (line == "CF:NEWLINE"):
                     case["cflags"].append("F_NEWLINE")
+                elif (line == "CF:STREAM"):
+                    case["cflags"].append("F_STREAM")
+                elif (line == "CF:SET"):
+                    case["cflags"].append("F_SET")
+                elif (line == "CF:LOAD"):
+                    case["cflags"].append("F_LOAD")
+                elif (line == "CF:CACHE"):
+                    case["cflags"].append("F_CACHE")
+                elif (line == "CF:LIMIT"):
+                    case["cflags"].append("F_LIMIT")
+                elif (line == "CF:YIELD"):
+                    case["cflags"].append("F_YIELD")
+                elif (line == "CF:REUSE"):
+                    case["cflags"].append("F_REUSE")
+                elif (line == "CF:FROM"):
+                    case["cflags"].append("F_FROM")
+                elif (line == "CF:ALL"):
+                    case["cflags"].append("F_ALL")
+                elif (line == "CF:STOP"):
+                    case["cflags"].append("F_STOP")
+                elif (line == "CF:CORRUPT"):
+                    case["cflags"].append("F_CORRUPT")
                 else:
                     print("Unknown flag: " + line[2:])
                     sys.exit(1)
@@ -20,10 +20,12 @@ extern struct engine slre_engine;
 extern struct engine tiny_regex_c_engine;
 extern struct engine subreg_engine;
 extern struct engine rele_engine;
+extern struct engine rele_jit_engine;
 
 
 struct engine *engines[] = {
     &rele_engine,
+    &rele_jit_engine,
     &libc_engine,
     &newlib_engine,
     &pcre_engine,
@@ -5,7 +5,53 @@
 #include <stdlib.h>
 #include "../shim.h"
 #include "../test.h"
+#include <string.h>
 static struct rectx *rele_ctx;
+static struct rematch *rele_stream;         // if we are testing streaming
+
+// Streams get fed the text in small chunks so matches cross the edges
+#define STREAM_CHUNK        7
+
+// A set reports the earliest match of each pattern as its groups
+#define SET_MAX             32
+static int rele_set;
+static struct rele_match_t rele_set_res[SET_MAX];
+
+// A serialized copy that we load and match from instead
+static void *rele_blob;
+
+// Steps a match gets with F_LIMIT, running out is reported as no match
+#define MATCH_LIMIT         10000
+
+// With F_YIELD we match this many steps at a time until it's finished
+#define YIELD_STEPS         5
+static int rele_yield;
+
+// With F_REUSE the buffer we match in has just had the text twice over in it,
+// so anything kept from that match points past the end of this one
+static int rele_reuse;
+
+// With F_FROM the match starts looking this far into the text
+#define FROM_OFFSET         4
+static int rele_from;
+
+// With F_ALL we report group 0 of each match, F_STOP has the callback stop
+// after ALL_STOP of them
+#define ALL_MAX             32
+#define ALL_STOP            2
+static int rele_all;
+static int rele_all_count;
+static struct rele_match_t rele_all_res[ALL_MAX];
+
+static int rele_all_cb(void *arg, struct rele_match_t *groups, int count) {
+    if (rele_all_count < ALL_MAX) rele_all_res[rele_all_count] = groups[0];
+    rele_all_count++;
+    return ((rele_all & F_STOP) && rele_all_count == ALL_STOP);
+}
+
+// Set by the rele-jit engine, RELE_NATIVE falls back to the task matcher where
+// there isn't any native code
+static int rele_jit;
 
 int librele_compile(char *regex, int flags) {
     int real_flags = 0;
@@ -13,30 +59,156 @@ int librele_compile(char *regex, int flags) {
 
     if (flags & F_ICASE) real_flags |= RELE_CASELESS;
     if (flags & F_NEWLINE) real_flags |= RELE_NEWLINE;
+    if (flags & F_STREAM) real_flags |= RELE_STREAM;
+    if (rele_jit) real_flags |= RELE_NATIVE;
+
+    if (flags & F_SET) {
+        static char buf[1024];
+        char *pats[SET_MAX];
+        char *p = strncpy(buf, regex, sizeof(buf) - 1);
 
-    rele_ctx = rele_compile(regex, real_flags, &err);
+        rele_set = 0;
+        while (rele_set < SET_MAX) {
+            pats[rele_set++] = p;
+            if (!(p = strstr(p, ";;"))) break;
+            *p = 0;
+            p += 2;
+        }
+        rele_ctx = rele_compile_set(pats, rele_set, real_flags, &err);
+    } else if (flags & F_CACHE) {
+        // Compiling it again has to be a hit that gives us our own ctx
+        struct rele_cache_stats before, after;
+        struct rectx *first = rele_cache_compile(regex, real_flags, &err);
+        if (!first) return err;
+
+        rele_cache_stats(&before);
+        rele_ctx = rele_cache_compile(regex, real_flags, &err);
+        rele_cache_stats(&after);
+        rele_free(first);
+        if (rele_ctx == first || after.hits != before.hits + 1) {
+            if (rele_ctx) rele_free(rele_ctx);
+            rele_ctx = (struct rectx *)NULL;
+            return RELE_CE_INTERR;
+        }
+    } else {
+        rele_ctx = rele_compile(regex, real_flags, &err);
+    }
     if (!rele_ctx) return err;
+    if (flags & F_LOAD) {
+        int size = rele_serialize(rele_ctx, NULL, 0);
+        rele_blob = malloc(size);
+        rele_serialize(rele_ctx, rele_blob, size);
+        if (flags & F_CORRUPT) ((char *)rele_blob)[size / 2] ^= 0x10;
+        rele_free(rele_ctx);
+        rele_ctx = rele_load(rele_blob, size, &err);
+        if (!rele_ctx) return err;
+
+        // Saving the loaded one has to give us the same blob back
+        void *again = malloc(size);
+        int same = (again && rele_serialize(rele_ctx, again, size) == size && !memcmp(again, rele_blob, size));
+        free(again);
+        if (!same) {
+            rele_free(rele_ctx);
+            rele_ctx = (struct rectx *)NULL;
+            return RELE_CE_INTERR;
+        }
+    }
+    if (flags & F_LIMIT) rele_match_limit(rele_ctx, MATCH_LIMIT);
+    if (flags & F_YIELD) {
+        rele_match_limit(rele_ctx, YIELD_STEPS);
+        rele_yield = RELE_YIELD;
+    }
+    if (flags & F_REUSE) rele_reuse = 1;
+    if (flags & F_FROM) rele_from = FROM_OFFSET;
+    if (flags & F_ALL) rele_all = flags & (F_ALL | F_STOP);
+    if (flags & F_STREAM) {
+        rele_stream = rele_state_new(rele_ctx);
+        if (flags & F_LIMIT) rele_state_limit(rele_stream, MATCH_LIMIT);
+    }
     //rele_export_tree(rele_ctx, "out.dot");
     return 1;
 }
+int librele_jit_compile(char *regex, int flags) {
+    rele_jit = 1;
+    int rc = librele_compile(regex, flags);
+    rele_jit = 0;
+    return rc;
+}
 int librele_match(char *text, int flags) {
-    if (rele_match(rele_ctx, text, 0, flags)) return 1;
-    return 0;
+    if (rele_stream) {
+        int len = strlen(text);
+
+        rele_stream_begin(rele_stream, flags);
+        for (int i = 0; i < len; i += STREAM_CHUNK) {
+            int n = (len - i < STREAM_CHUNK) ? len - i : STREAM_CHUNK;
+            int rc = rele_stream_feed(rele_stream, text + i, n);
+            if (rc) return (rc > 0);
+        }
+        return (rele_stream_end(rele_stream) > 0);
+    }
+    if (rele_set) {
+        uint32_t hits[RELE_SET_WORDS(SET_MAX)];
+        return (rele_match_set(rele_ctx, text, 0, flags, hits, rele_set_res) > 0);
+    }
+    if (rele_all) {
+        // Every match has to have been through the callback
+        rele_all_count = 0;
+        int rc = rele_match_all(rele_ctx, text, 0, flags, rele_all_cb, NULL);
+        return (rc > 0 && rc == rele_all_count);
+    }
+    if (rele_from) return (rele_match_from(rele_ctx, text, 0, rele_from, flags) > 0);
+    if (rele_reuse) {
+        int len = strlen(text);
+        char *buf = malloc(len * 2 + 1);
+        if (!buf) return 0;
+
+        memcpy(buf, text, len);
+        memcpy(buf + len, text, len + 1);
+        rele_match(rele_ctx, buf, 0, flags);
+        memcpy(buf, text, len + 1);
+        int rc = rele_match(rele_ctx, buf, 0, flags);
+        free(buf);
+        return (rc > 0);
+    }
+    int rc = rele_match(rele_ctx, text, 0, flags | rele_yield);
+    while (rc == RELE_ME_INPROGRESS) rc = rele_match_resume(rele_ctx);
+    return (rc > 0);
 }
 int librele_res_count() {
+    if (rele_set) return rele_set;
+    if (rele_all) return (rele_all_count < ALL_MAX ? rele_all_count : ALL_MAX);
     return rele_match_count(rele_ctx);
 }
 int librele_res_so(int res) {
+    if (rele_set) return rele_set_res[res].rm_so;
+    if (rele_all) return rele_all_res[res].rm_so;
+    if (rele_stream) return rele_state_match(rele_stream, res)->rm_so;
     return rele_get_match(rele_ctx, res)->rm_so;
 }
 int librele_res_eo(int res) {
+    if (rele_set) return rele_set_res[res].rm_eo;
+    if (rele_all) return rele_all_res[res].rm_eo;
+    if (rele_stream) return rele_state_match(rele_stream, res)->rm_eo;
     return rele_get_match(rele_ctx, res)->rm_eo;
 }
 int librele_free() {
+    if (rele_stream) {
+        rele_state_free(rele_stream);
+        rele_stream = (struct rematch *)NULL;
+    }
     if (rele_ctx) {
         rele_free(rele_ctx);
         rele_ctx = (struct rectx *)NULL;
     }
+    if (rele_blob) {
+        free(rele_blob);
+        rele_blob = NULL;
+    }
+    rele_set = 0;
+    rele_yield = 0;
+    rele_reuse = 0;
+    rele_from = 0;
+    rele_all = 0;
     return 1;
 }
 int librele_tree() {
@@ -54,3 +226,14 @@ struct engine rele_engine = {
     .free = librele_free,
     .tree = librele_tree,
 };
+
+struct engine rele_jit_engine = {
+    .name = "rele-jit",
+    .compile = librele_jit_compile,
+    .match = librele_match,
+    .res_count = librele_res_count,
+    .res_so = librele_res_so,
+    .res_eo = librele_res_eo,
+    .free = librele_free,
+    .tree = librele_tree,
+};
@@ -9,6 +9,17 @@ struct result {
 enum {
     F_ICASE = (1 << 0),
     F_NEWLINE = (1 << 1),
+    F_STREAM = (1 << 2),        // (rele) feed the text in chunks
+    F_SET = (1 << 3),           // (rele) regex is patterns split by ;;
+    F_LOAD = (1 << 4),          // (rele) match from a serialized copy
+    F_CACHE = (1 << 5),         // (rele) compile through the cache
+    F_LIMIT = (1 << 6),         // (rele) give up after a fixed number of steps
+    F_YIELD = (1 << 7),         // (rele) match a few steps at a time
+    F_REUSE = (1 << 8),         // (rele) match in a buffer just used for a longer text
+    F_FROM = (1 << 9),          // (rele) start looking a few chars into the text
+    F_ALL = (1 << 10),          // (rele) every match, the results are their group 0s
+    F_STOP = (1 << 11),         // (rele) with F_ALL stop after the second match
+    F_CORRUPT = (1 << 12),      // (rele) with F_LOAD flip a bit in the blob first
 };
 
 enum {
@@ -5,10 +5,10 @@
  * 
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>      // remove, for debug only
 #include <ctype.h>
 
 #include "rele.h"
@@ -16,6 +16,35 @@
 // Include an ID in the nodes to help with debugging and tree visualisation
 #define DEBUG_ID    
 
+// Build with RELE_STATS defined to count what each match does, see
+// rele_get_stats(), without it the counting compiles away.
+#ifdef RELE_STATS
+#define STAT_ADD(m, f, v)       ((m)->stats.f += (v))
+#define STAT_MAX(m, f, v)       do { if ((uint32_t)(v) > (m)->stats.f) (m)->stats.f = (v); } while (0)
+#define STAT_LIVE(m, v)         do { (m)->live += (v); STAT_MAX(m, peak, (m)->live); } while (0)
+#else
+#define STAT_ADD(m, f, v)
+#define STAT_MAX(m, f, v)
+#define STAT_LIVE(m, v)
+#endif
+
+// Build with RELE_HEATMAP defined to count what happens at each node, these
+// end up in the rele_export_tree() output. Only the interpreter counts.
+#ifdef RELE_HEATMAP
+struct heat {
+    uint32_t        visits;         // times a task was run at the node
+    uint32_t        spawns;         // tasks created by a split here
+    uint32_t        deaths;         // tasks that died here
+    uint32_t        bytes;          // text consumed here
+    uint32_t        dedupes;        // tasks killed as a duplicate here
+};
+#define HEAT_SIZE               sizeof(struct heat)
+#define HEAT_ADD(m, n, f, v)    ((m)->heat[(n) - (m)->ctx->node_base].f += (v))
+#else
+#define HEAT_SIZE               0
+#define HEAT_ADD(m, n, f, v)    do { } while (0)
+#endif
+
 
 enum {
     // Order in terms of liklihood
@@ -50,40 +79,74 @@ enum {
 
 struct node {
     union {
-        struct node      *a;            // the first child
+        int16_t         a;              // the first child
         struct {
             uint16_t    min;
             uint16_t    max;
         };
         int             len;            // for string matches
+        int             id;             // which pattern a DONE is for (sets)
         uint8_t         group;          // for creating groups
     };
     union {
-        struct node     *b;             // the second child
-        struct set      *set;           // a possible set match
-        char            *string;        // a possible string match
-        struct node     *match;         // a DOTSTAR next match node
+        int16_t         b;              // the second child
+        int32_t         set;            // a possible set match
+        int32_t         string;         // a possible string match
+        int16_t         match;          // a DOTSTAR next match node
         uint8_t         mgrp;           // a possible group match
         struct {
             char            ch1;        // normal char
             char            ch2;        // or special char
+            uint8_t         cls;        // CLASS_xxx bit for \d, \w, dot etc.
         };
     };
-    struct node         *parent;        // for a way back
+    int16_t             parent;         // for a way back
     uint8_t             op;             // which operation?
     uint8_t             lazy;           // won't fit in a with minmax
-    // Two bytes unused here (if 32bit)
-
-    // A 32bit value here to allow us to detect zero length matches
-    uint32_t            iter;
 };
 
+// Nodes link to each other with an offset from themselves (0 for none), so
+// they are small, sit several to a cache line and don't care where they are
+// in memory. This limits us to 32K nodes.
+#define MAX_NODES               0x7fff
+#define LINK(n, off)            ((off) ? (n) + (off) : NULL)
+#define OFFSET(n, x)            ((x) ? (int16_t)((x) - (n)) : 0)
+#define LEG_A(n)                LINK(n, (n)->a)
+#define LEG_B(n)                LINK(n, (n)->b)
+#define PARENT(n)               LINK(n, (n)->parent)
+#define MATCH_NODE(n)           LINK(n, (n)->match)
+
+// Sets and strings come after the nodes in the same block
+#define NODE_SET(n)             ((struct set *)((char *)(n) + (n)->set))
+#define NODE_STR(n)             ((char *)(n) + (n)->string)
+#define BYTE_OFFSET(n, x)       ((int32_t)((char *)(x) - (char *)(n)))
+
 // Where we have nodes that don't need children we need to mark the
 // b-leg otherwise it will be used by something...
+#define EMPTY_LEG               INT16_MIN
+#define EMPTY_GROUP(n)          ((n)->b == EMPTY_LEG)
+
+// Used by the optimiser to say we've ruled something out
 #define NOTUSED     (struct node *)1
 
+// A set of bytes held as a pair of nibble lookup tables, for each low nibble
+// lo[] has a bit per high nibble (0-7) and hi[] the same for 8-15. This lets
+// us check lots of bytes at once with a byte shuffle (see SCANNING). Without
+// a shuffle the ascii part as a few first,last ranges does a word at a time.
+#define SCAN_RANGES     4
+#define SCAN_NORANGE    0xff        // too many ranges to be worth it
+
+struct scanset {
+    uint8_t     lo[16];
+    uint8_t     hi[16];
+    uint8_t     range[SCAN_RANGES][2];
+    uint8_t     ranges;             // how many (or SCAN_NORANGE)
+    uint8_t     high;               // something from 0x80 up is in the set
+};
+
 
-// We have a 'context' which contains the root of the tree
+// We have a 'context' which contains the root of the tree. Once compiled this
+// is never written to, so it can be shared by any number of matchers.
 struct rectx {
     struct node     *root;
 
@@ -92,37 +155,173 @@ struct rectx {
     struct set      *sets;          // current set pointer
     char            *strings;       // for string matches
 
-    struct task     *free_list;     // free tasks list
-    struct task     *done;          // the candiate completed task
+    struct node     *node_base;     // first node (for node ids)
+    int             node_count;     // how many nodes we actually used
+
+    int             slab_tasks;     // tasks preallocated in each match state
+    int             task_size;      // including the group matches
+    uint16_t        depth;          // counters a task can be inside at once
+    uint16_t        loops;          // loops a task can be inside at once
+
+    uint8_t         *bclass;        // byte to class map, if we can use the DFA
+    uint16_t        nclasses;       // how many classes
+    uint8_t         dfa_context;    // anchors need to know the prior char
+    int             dfa_items;      // most items a DFA state can have
+    uint8_t         rdfa;           // match states have a reverse DFA too
+    uint8_t         tail;           // TAIL_xxx, how the pattern ends
+    uint8_t         anchored;       // every match starts at the start of the text
+
+    struct rematch  *state;         // default match state for rele_match()
+    struct jit      *jit;           // native code for the tasks (RELE_NATIVE)
+    struct cache_entry *cached;     // a handle from rele_cache_compile()
+    uint32_t        size;           // bytes in the block
 
     struct node     *fast_start;    // used for optimisation
 
+    struct scanset  first;          // the chars a match could start with
+    uint16_t        first_count;    // how many (or 0 if we don't know)
+    char            first_ch;       // the only one, if there's just one
+
+    char            req;            // a char every match must contain (or 0)
+    uint16_t        req_min;        // how far into a match it can be
+    uint16_t        req_max;
+
     uint16_t        flags;
+    uint16_t        set_count;      // how many patterns, if we are a set
     uint8_t         groups;         // allows up to 255 groups
-    uint8_t         pad;            // not used
+    uint8_t         has;            // HAS_xxx, features that affect matching
+
+    // Memory for the default state, nodes and sets will follow this...
+};
+
+// A pattern that ends in \Z can only match at the end of the text, one
+// ending in $ can too if there aren't any newlines.
+#define TAIL_END        1
+#define TAIL_EOL        2
+
+// If we have counters or backreferences then the node alone isn't enough to
+// say if two tasks are in the same state
+#define HAS_MULT        (1 << 0)
+#define HAS_BACKREF     (1 << 1)
+
+// Everything that changes while matching lives in the match state, so we can
+// have one per thread against the same compiled context.
+struct rematch {
+    struct rectx    *ctx;           // the compiled regex we belong to
 
-    // Memory for nodes and sets will follow this...
+    struct task     *free_list;     // free tasks list
+    struct task     *done;          // the candiate completed task
+
+    uint32_t        limit;          // steps a match can take (0 for no limit)
+#ifdef RELE_STATS
+    struct rele_stats stats;        // what the last match did
+    uint32_t        live;           // tasks not on the free list
+#endif
+#ifdef RELE_HEATMAP
+    struct heat     *heat;          // per node counts, never reset
+#endif
+    uint32_t        gen;            // bumped for every position we process
+
+    // Per node arrays, these follow the structure in memory...
+    uint32_t        *seen;          // gen when a task last matched this node
+    struct task     **waiter;       // a task waiting on a DOTSTAR/DOTPLUS match
+
+    // Preallocated tasks, these follow the per node arrays...
+    void            *slab;
+    void            *slab_end;
+
+    // The DFA state cache (if we can use one) follows the slab, then the
+    // reverse one if the pattern can only match at the end
+    struct dfa      *dfa;
+    struct dfa      *rdfa;
+
+    char            *req_hit;       // where we last found the required char
+    struct jit_run  *jit_run;       // thread lists for the native code, allocated when first used
+
+    // What a pattern set has found so far, see rele_exec_set()
+    uint32_t        *hits;          // a bit per pattern
+    struct rele_match_t *earliest;  // the first match of each (if wanted)
+    int             hit_count;      // how many patterns have matched
+
+    // Where we got to with a stream, see rele_stream_begin()
+    struct task     *run_list;      // what was still running at the end of the last chunk
+    int32_t         offset;         // of the next chunk in the stream
+    int32_t         cand;           // next place a match could start, -1 if there isn't one
+    int             sflags;         // match flags for the stream
+    char            pc;             // the char before the next chunk
+    char            done_pc;        // the char before the end of the candidate match
+    uint8_t         stream;         // STREAM_xxx
+
+    // Where a match that yielded got to (RELE_YIELD), the tasks that were
+    // running are kept in run_list, see rele_exec_resume()
+    struct resume {
+        char        *start;
+        char        *p;
+        char        *end;
+        char        *cand;          // next place a match could start
+        int         flags;
+        uint8_t     seed;           // still adding new starts
+        uint8_t     once;
+        uint8_t     jit;            // it was the native code that stopped
+        uint8_t     active;
+    } resume;
 };
 
-#define NOT_FLAG(v, f)           (!(v & f))
-#define HAS_FLAG(v, f)           (v & f)
+static void ctx_free(struct rectx *ctx);
+static void cache_release(struct cache_entry *e);
+
+// Native code for the task matcher, see JIT at the end
+static struct jit *jit_build(struct rectx *ctx);
+static void jit_free(struct jit *j);
+static int jit_exec(struct rematch *m, char *start, char *p, char *end, int flags);
+static uint32_t jit_held(struct rematch *m);
+static uint32_t jit_code_size(struct jit *j);
+
+// What jit_exec() returns if it couldn't get the memory, the task matcher
+// gets a go instead (it mustn't be one of the RELE_ME_xxx codes)
+#define JIT_NOMEM       (-99)
+
+#define STREAM_ON       (1 << 0)    // we are matching a stream
+#define STREAM_MORE     (1 << 1)    // there's more to come after this chunk
+#define STREAM_MATCHED  (1 << 2)    // the last chunk finished a match
 
-#define NODE_ID(ctx, n)          (int)(((void *)n - ((void *)ctx + sizeof(struct rectx)))/sizeof(struct node))
+// Size of a match state including the per node arrays, the task slab and the DFA
+#define STATE_SIZE(nodes, tasks, tsize, dfa)    (ALIGN_PTR(sizeof(struct rematch) + \
+                    (nodes) * (sizeof(struct task *) + sizeof(uint32_t) + HEAT_SIZE)) + ((tasks) * (tsize)) + (dfa))
+
+// Counters and backreferences can keep more than one task per node alive, the
+// slab gets up to this many more for them. A match that needs more than the
+// slab has gives up with RELE_ME_LIMIT.
+#define MAX_SLAB_TASKS          1024
+
+// Limits on what the DFA can cope with, and how much cache it can use
+#define DFA_MAX_NODES           0xffff
+#define DFA_MAX_STRING          0x3fff
+#define DFA_MAX_CACHE           16384
+
+#define NOT_FLAG(v, f)           (!((v) & (f)))
+#define HAS_FLAG(v, f)           ((v) & (f))
+
+#define NODE_ID(ctx, n)          (int)((n) - (ctx)->node_base)
 
 #define SET_ERR(v)               if (error) *error = v;
 
+// Round up a size so that whatever follows it is pointer aligned
+#define ALIGN_PTR(v)             (((v) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
 static struct node *create_node_above(struct rectx *ctx, struct node *this, uint8_t op, struct node *a, struct node *b) {
-    struct node *parent = this->parent;
+    struct node *parent = PARENT(this);
     struct node *n = ctx->nodes++;          // alloc (kind of)
-    n->parent = parent;
-    this->parent = n;
+    n->parent = OFFSET(n, parent);
+    this->parent = OFFSET(this, n);
 
-    // Now update the correct leg of the parent
+    // Now update the correct leg of the parent, only concat and alternate
+    // use a, for everything else it's part of something else
     if (parent) {
-        if (parent->a == this) {
-            parent->a = n;
+        if (LEG_B(parent) == this) {
+            parent->b = OFFSET(parent, n);
         } else {
-            parent->b = n;
+            parent->a = OFFSET(parent, n);
         }
     } else {
         // Top of the tree
@@ -130,8 +329,8 @@ static struct node *create_node_above(struct rectx *ctx, struct node *this, uint
     }
     // Now set the right values...
     n->op = op;
-    n->a = a;
-    n->b = b;
+    n->a = OFFSET(n, a);
+    n->b = OFFSET(n, b);
     return n;
 }
 
@@ -143,21 +342,22 @@ static struct node *create_node_above(struct rectx *ctx, struct node *this, uint
 static struct node *create_node_here(struct rectx *ctx, struct node *last, uint8_t op, struct node *a, struct node *b) {
     struct node *n = ctx->nodes++;  // alloc - kind of
     n->op = op;
-    n->a = a;
-    n->b = b;
+    n->a = OFFSET(n, a);
+    n->b = OFFSET(n, b);
 
     if (!last) {
         // We are the top of the tree
-        n->parent = NULL;
+        n->parent = 0;
         ctx->root = n;
     } else if (!last->b) {
         // TODO: if b happens to be zero on the wrong type of node this could go wrong, need to protect
         // against it, probably by checking op type (only concat and alternate can use b as a node?)
-        last->b = n;
-        n->parent = last;
+        last->b = OFFSET(last, n);
+        n->parent = OFFSET(n, last);
     } else {
         // We need a concat...
-        n->parent = create_node_above(ctx, last, OP_CONCAT, last, n);
+        struct node *concat = create_node_above(ctx, last, OP_CONCAT, last, n);
+        n->parent = OFFSET(n, concat);
     }
     return n;
 }
@@ -166,39 +366,337 @@ static struct node *create_node_here(struct rectx *ctx, struct node *last, uint8
 // -------------------------------------------------------------------------------
 // TASKS
 // -------------------------------------------------------------------------------
-#define TASK_STACK_SIZE      3
-
 struct task {
     struct task         *next;          // tasks are singly linked
     struct node         *n;             // current node
     struct node         *last;          // last one we processed (for direction)
 
     char                *p;             // pointer to the DONE index and for wait
+    uint32_t            gen;            // gen when last skipped while waiting
+    uint32_t            took_gen;       // gen when we last consumed at took
+    struct node         *took;
 
     // Stack mechanism for {x,y} counting
     uint16_t            sp;             // more an index than pointer (smaller)
-    uint16_t            stack[TASK_STACK_SIZE];
+    uint16_t            lp;             // same for where each loop went round
 
-    // All of the group matches follow...
+    // All of the group matches follow, then the loop positions, then the
+    // counter stack...
     struct rele_match_t   grp[];
 };
 
-static int tcount = 0;      // TODO: might want to remove and use #defined debug code
+#define TASK_SIZE(groups, loops, depth) ALIGN_PTR(sizeof(struct task) + ((groups) * sizeof(struct rele_match_t)) + \
+                                                ((loops) * sizeof(int32_t)) + ((depth) * sizeof(uint16_t)))
+#define TASK_LOOPS(ctx, t)      ((int32_t *)&(t)->grp[(ctx)->groups])
+#define TASK_STACK(ctx, t)      ((uint16_t *)(TASK_LOOPS(ctx, t) + (ctx)->loops))
 
 
 /*
  * Some helper functions
  */
 int rele_match_count(struct rectx *ctx) { return ctx->groups; }
-struct rele_match_t *rele_get_match(struct rectx *ctx, int n) { return &(ctx->done->grp[n]); }
-struct rele_match_t *rele_get_matches(struct rectx *ctx) { return ctx->done->grp; }
+struct rele_match_t *rele_get_match(struct rectx *ctx, int n) { return &(ctx->state->done->grp[n]); }
+struct rele_match_t *rele_get_matches(struct rectx *ctx) { return ctx->state->done->grp; }
+
+struct rele_match_t *rele_state_match(struct rematch *m, int n) { return &(m->done->grp[n]); }
+struct rele_match_t *rele_state_matches(struct rematch *m) { return m->done->grp; }
+
+
+// -------------------------------------------------------------------------------
+// SCANNING
+//
+// Looking for the next place something could match, these check as many bytes
+// at once as we can. Sets use the nibble tables in struct scanset with a byte
+// shuffle, SSSE3/AVX2 on x86-64 picked at runtime or NEON on ARM if we are
+// built for it (the armhf Makefile does). Otherwise the plain C version checks
+// a word at a time against the ascii ranges and only looks at the bytes of a
+// word that has something in it (or something from 0x80 up).
+// -------------------------------------------------------------------------------
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCAN_NEON
+#endif
+
+#define SCAN_HAS(s, c)      (((c) < 128 ? (s)->lo : (s)->hi)[(c) & 15] & (1 << (((c) >> 4) & 7)))
+
+// Build the nibble tables and ranges from a bitmap of the first nbits bytes
+static void scanset_build(struct scanset *s, const uint32_t *bits, int nbits) {
+    memset(s, 0, sizeof(struct scanset));
+    for (int c=0; c < nbits; c++) {
+        if (!(bits[c >> 5] & ((uint32_t)1 << (c & 31)))) continue;
+        if (c < 128) s->lo[c & 15] |= 1 << (c >> 4); else s->hi[c & 15] |= 1 << ((c >> 4) & 7);
+        if (c >= 128) { s->high = 1; continue; }
+
+        // Carry on the last range or start a new one
+        if (s->ranges == SCAN_NORANGE) continue;
+        if (s->ranges && s->range[s->ranges - 1][1] == c - 1) { s->range[s->ranges - 1][1] = c; continue; }
+        if (s->ranges == SCAN_RANGES) { s->ranges = SCAN_NORANGE; continue; }
+        s->range[s->ranges][0] = s->range[s->ranges][1] = c;
+        s->ranges++;
+    }
+}
+
+// The classes matchone() knows about, and newline for the multi-line dot
+static const struct scanset scan_digit = {
+    { 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0 },
+    { { '0', '9' } }, 1, 0 };
+static const struct scanset scan_word = {
+    { 0xa8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf8, 0xf0, 0x50, 0x50, 0x50, 0x50, 0x70 }, { 0 },
+    { { '0', '9' }, { 'A', 'Z' }, { '_', '_' }, { 'a', 'z' } }, 4, 0 };
+static const struct scanset scan_space = {
+    { 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00 }, { 0 },
+    { { 9, 13 }, { ' ', ' ' } }, 2, 0 };
+static const struct scanset scan_newline = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0 },
+    { { '\n', '\n' } }, 1, 0 };
+
+static char *scan_set_c(const struct scanset *s, char *p, char *end, int negate) {
+    if (s->ranges != SCAN_NORANGE) {
+        // A byte x (under 0x80) is in first,last if (127 + last + 1) - x and
+        // x + (127 - (first - 1)) both have their top bit set, with the top
+        // bit cleared first nothing carries into the next byte.
+        uintptr_t ones = (uintptr_t)-1 / 255, top = ones << 7, low = ones * 0x7f;
+        uintptr_t below[SCAN_RANGES], above[SCAN_RANGES];
+        int w = sizeof(uintptr_t);
+
+        for (int i = 0; i < s->ranges; i++) {
+            below[i] = ones * (128 + s->range[i][1]);
+            above[i] = ones * (128 - s->range[i][0]);
+        }
+        while (end - p >= w) {
+            uintptr_t v, x, in = 0;
+            memcpy(&v, p, sizeof(v));
+            x = v & low;
+            for (int i = 0; i < s->ranges; i++) in |= (below[i] - x) & (x + above[i]);
+            in &= ~v & top;
+
+            // Bytes from 0x80 up aren't in any range so the table has the say
+            if (negate ? (~in & top) : (in | (s->high ? v & top : 0))) {
+                for (char *q = p + w; p < q; p++) {
+                    unsigned char c = *p;
+                    if ((SCAN_HAS(s, c) != 0) != negate) return p;
+                }
+                continue;
+            }
+            p += w;
+        }
+    }
+    for (; p < end; p++) {
+        unsigned char c = *p;
+        if ((SCAN_HAS(s, c) != 0) != negate) return p;
+    }
+    return NULL;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("avx2")))
+static char *scan_set_avx2(const struct scanset *s, char *p, char *end, int negate) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)s->lo));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)s->hi));
+    __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                    1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m256i top = _mm256_set1_epi8(-128);
+    __m256i seven = _mm256_set1_epi8(7);
+    uint32_t flip = negate ? 0 : 0xffffffff;
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i t = _mm256_or_si256(_mm256_shuffle_epi8(lo, v), _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, top)));
+        __m256i b = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), seven));
+        __m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(t, b), _mm256_setzero_si256());
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(none) ^ flip;
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return scan_set_c(s, p, end, negate);
+}
+
+__attribute__((target("ssse3")))
+static char *scan_set_ssse3(const struct scanset *s, char *p, char *end, int negate) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)s->lo);
+    __m128i hi = _mm_loadu_si128((const __m128i *)s->hi);
+    __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i top = _mm_set1_epi8(-128);
+    __m128i seven = _mm_set1_epi8(7);
+    uint32_t flip = negate ? 0 : 0xffff;
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i t = _mm_or_si128(_mm_shuffle_epi8(lo, v), _mm_shuffle_epi8(hi, _mm_xor_si128(v, top)));
+        __m128i b = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), seven));
+        __m128i none = _mm_cmpeq_epi8(_mm_and_si128(t, b), _mm_setzero_si128());
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(none) ^ flip;
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_set_c(s, p, end, negate);
+}
+#endif
+
+#ifdef SCAN_NEON
+static char *scan_set_neon(const struct scanset *s, char *p, char *end, int negate) {
+    static const uint8_t bitv[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x8x2_t lo = {{ vld1_u8(s->lo), vld1_u8(s->lo + 8) }};
+    uint8x8x2_t hi = {{ vld1_u8(s->hi), vld1_u8(s->hi + 8) }};
+    uint8x8x2_t bits = {{ vld1_u8(bitv), vld1_u8(bitv + 8) }};
+
+    while (end - p >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p);
+        uint8x16_t idx = vandq_u8(v, vdupq_n_u8(0x0f));
+        uint8x16_t hn = vshrq_n_u8(v, 4);
+        uint8x16_t tl = vcombine_u8(vtbl2_u8(lo, vget_low_u8(idx)), vtbl2_u8(lo, vget_high_u8(idx)));
+        uint8x16_t th = vcombine_u8(vtbl2_u8(hi, vget_low_u8(idx)), vtbl2_u8(hi, vget_high_u8(idx)));
+        uint8x16_t b = vcombine_u8(vtbl2_u8(bits, vget_low_u8(hn)), vtbl2_u8(bits, vget_high_u8(hn)));
+        uint8x16_t in = vtstq_u8(vbslq_u8(vcgeq_u8(v, vdupq_n_u8(128)), th, tl), b);
+        if (negate) in = vmvnq_u8(in);
+        uint64x2_t w = vreinterpretq_u64_u8(in);
+        if (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1)) break;     // it's in here somewhere
+        p += 16;
+    }
+    return scan_set_c(s, p, end, negate);
+}
+#endif
+
+/**
+ * Find the first byte that is in the set (or not if negate) from p.
+ */
+static char *scan_set(const struct scanset *s, char *p, char *end, int negate) {
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2")) return scan_set_avx2(s, p, end, negate);
+    if (__builtin_cpu_supports("ssse3")) return scan_set_ssse3(s, p, end, negate);
+#endif
+#ifdef SCAN_NEON
+    return scan_set_neon(s, p, end, negate);
+#endif
+    return scan_set_c(s, p, end, negate);
+}
+
+/**
+ * Find a single char from p, if caseless then c is lower case and upper and
+ * lower case letters only differ by 0x20.
+ */
+static char *scan_byte(char *p, char *end, char c, int icase) {
+    if (p >= end) return NULL;
+    if (!icase || !islower((unsigned char)c)) return memchr(p, c, end - p);
+
+#ifdef SCAN_X86
+    __m128i fold = _mm_set1_epi8(0x20), want = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *)p), fold);
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, want));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(SCAN_NEON)
+    while (end - p >= 16) {
+        uint8x16_t v = vorrq_u8(vld1q_u8((const uint8_t *)p), vdupq_n_u8(0x20));
+        uint64x2_t w = vreinterpretq_u64_u8(vceqq_u8(v, vdupq_n_u8(c)));
+        if (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1)) break;
+        p += 16;
+    }
+#else
+    // A word at a time, a zero byte in (w | fold) ^ want is a match
+    uintptr_t ones = (uintptr_t)-1 / 255;
+    uintptr_t fold = ones * 0x20, want = ones * (unsigned char)c;
+    while (end - p >= (int)sizeof(uintptr_t)) {
+        uintptr_t w;
+        memcpy(&w, p, sizeof(w));
+        w = (w | fold) ^ want;
+        if ((w - ones) & ~w & (ones << 7)) break;
+        p += sizeof(uintptr_t);
+    }
+#endif
+    for (; p < end; p++) { if ((*p | 0x20) == c) return p; }
+    return NULL;
+}
+
+/**
+ * Find the next place a special char match (\d, \w etc.) could match.
+ */
+static char *scan_class(char s, char *p, char *end) {
+    switch (s) {
+        case '.':   return (p < end) ? p : NULL;
+        case ',':   return scan_set(&scan_newline, p, end, 1);
+        case 'd':
+        case 'D':   return scan_set(&scan_digit, p, end, s == 'D');
+        case 'w':
+        case 'W':   return scan_set(&scan_word, p, end, s == 'W');
+        case 's':
+        case 'S':   return scan_set(&scan_space, p, end, s == 'S');
+    }
+    return (p < end) ? p : NULL;
+}
+
+
+// -------------------------------------------------------------------------------
+// CLASSES (\d, \w, \s, dot and their opposites)
+// -------------------------------------------------------------------------------
+
+// Each class gets a bit, the node keeps the bit for its class so a check
+// is just a lookup in class_table[]. This doesn't depend on the locale, and
+// anything from 0x80 up is only in the negated classes (and dot).
+#define CLASS_ANY       (1 << 0)        // .
+#define CLASS_NOTNL     (1 << 1)        // . with RELE_NEWLINE
+#define CLASS_DIGIT     (1 << 2)        // \d
+#define CLASS_NDIGIT    (1 << 3)        // \D
+#define CLASS_WORD      (1 << 4)        // \w
+#define CLASS_NWORD     (1 << 5)        // \W
+#define CLASS_SPACE     (1 << 6)        // \s
+#define CLASS_NSPACE    (1 << 7)        // \S
+
+static const uint8_t class_table[256] = {
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0x6b, 0x69, 0x6b, 0x6b, 0x6b, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0x6b, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0x97, 0x97, 0x97, 0x97, 0x97, 0x97, 0x97, 0x97, 0x97, 0x97, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b,
+    0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0xab, 0xab, 0xab, 0xab, 0x9b,
+    0xab, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b,
+    0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0x9b, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab,
+    0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab, 0xab
+};
+
+// The class bit for the special char s (as stored in ch2), or 0 if it
+// isn't one we know.
+static uint8_t class_bit(char s) {
+    switch (s) {
+        case '.':       return CLASS_ANY;
+        case ',':       return CLASS_NOTNL;
+        case 'd':       return CLASS_DIGIT;
+        case 'D':       return CLASS_NDIGIT;
+        case 'w':       return CLASS_WORD;
+        case 'W':       return CLASS_NWORD;
+        case 's':       return CLASS_SPACE;
+        case 'S':       return CLASS_NSPACE;
+    }
+    return 0;
+}
+
+static inline int matchone(uint8_t cls, char ch) {
+    return class_table[(unsigned char)ch] & cls;
+}
+
+// For \b and \B, a word char is whatever \w matches
+static inline int is_word(int ch) {
+    return (class_table[(unsigned char)ch] & CLASS_WORD) != 0;
+}
 
 
 // -------------------------------------------------------------------------------
 // SETS (of characters or ranges etc)
 // -------------------------------------------------------------------------------
 
-// Given a set of characters [abc\d1-0] etc, create a 128 bit mask that we
+// Given a set of characters [abc\d1-0] etc, create a 256 bit mask that we
 // can use to do rapid comparisons. The set will be linked into node b
 // of the supplied node, and the new pointer returned.
 //
@@ -208,7 +706,8 @@ struct rele_match_t *rele_get_matches(struct rectx *ctx) { return ctx->done->grp
 // it's more efficient.
 //
 struct set {
-    uint32_t d[4];
+    uint32_t d[8];
+    struct scanset scan;            // the same thing for scanning
 };
 
 //
@@ -220,12 +719,12 @@ static char *build_set(struct rectx *ctx, char *p, struct node *n) {
     struct set *set = ctx->sets++;
     int negate = 0;
 
-    #define SET_VAL(v)                      set->d[(v)/32] |= (1 << ((v)%32))
+    #define SET_VAL(v)                      set->d[(uint8_t)(v)/32] |= ((uint32_t)1 << ((uint8_t)(v)%32))
     #define SET_CASELESS_VAL(v)             SET_VAL(v); \
                                             if (v >= 'a' && v <= 'z') { SET_VAL(v - ('a' - 'A')); } \
                                             else if (v >= 'A' && v <= 'Z') { SET_VAL(v + ('a' - 'A')); }
-    #define SET_RANGE(beg, end)             for (uint8_t c = beg; c <= end; c++) { SET_VAL(c); }
-    #define SET_CASELESS_RANGE(beg, end)    for (uint8_t c = beg; c <= end; c++) { SET_CASELESS_VAL(c); }
+    #define SET_RANGE(beg, end)             for (int c = beg; c <= end; c++) { SET_VAL(c); }
+    #define SET_CASELESS_RANGE(beg, end)    for (int c = beg; c <= end; c++) { SET_CASELESS_VAL(c); }
 
     p++;            // get past the '['
     if (*p == '^') { negate = 1; p++; }
@@ -233,11 +732,11 @@ static char *build_set(struct rectx *ctx, char *p, struct node *n) {
         if (!*p) goto fail;
         if (*p == ']') break;           // done
         if (p[1] == '-' && p[2] && p[2] != ']') {
-            if (p[0] > p[2]) goto fail;
+            if ((uint8_t)p[0] > (uint8_t)p[2]) goto fail;
             if (ctx->flags & RELE_CASELESS) {
-                SET_CASELESS_RANGE(p[0], p[2]);
+                SET_CASELESS_RANGE((uint8_t)p[0], (uint8_t)p[2]);
             } else {
-                SET_RANGE(p[0], p[2]);
+                SET_RANGE((uint8_t)p[0], (uint8_t)p[2]);
             }
             p += 3;           
         } else {
@@ -251,9 +750,9 @@ static char *build_set(struct rectx *ctx, char *p, struct node *n) {
                                 SET_VAL('\r'); SET_VAL('\t'); SET_VAL('\v'); break;
                     case 'W':   SET_RANGE(0, '0'-1); SET_RANGE('9'+1, 'A'-1);
                                 SET_RANGE('Z'+1, '_'-1); SET_VAL(0x60);
-                                SET_RANGE('z'+1, 126); break;
-                    case 'D':   SET_RANGE(0, '0'-1); SET_RANGE('9'+1, 126); break;
-                    case 'S':   SET_RANGE(0, 8); SET_RANGE(14, 31); SET_RANGE(33, 126); break;
+                                SET_RANGE('z'+1, 255); break;
+                    case 'D':   SET_RANGE(0, '0'-1); SET_RANGE('9'+1, 255); break;
+                    case 'S':   SET_RANGE(0, 8); SET_RANGE(14, 31); SET_RANGE(33, 255); break;
                     case 't':   SET_VAL('\t'); break;
                     case 0:     goto fail;
                     default:    SET_VAL(*p); break;
@@ -269,12 +768,10 @@ static char *build_set(struct rectx *ctx, char *p, struct node *n) {
         }
     }
     if (negate) {
-        set->d[0] = ~set->d[0];
-        set->d[1] = ~set->d[1];
-        set->d[2] = ~set->d[2];
-        set->d[3] = ~set->d[3];
+        for (int i=0; i < 8; i++) set->d[i] = ~set->d[i];
     }
-    n->set = set;
+    scanset_build(&set->scan, set->d, 256);
+    n->set = BYTE_OFFSET(n, set);
     return ++p;                 // get past the close bracket
 
 fail:
@@ -302,10 +799,8 @@ char *dummy_set(char *p) {
 }
 
 static inline int match_set(char ch, struct set *set) {
-    if (set->d[ch/32] & ((uint32_t)(1 << (ch % 32)))) {
-        return 1;
-    }
-    return 0;
+    unsigned char c = ch;
+    return (set->d[c/32] >> (c % 32)) & 1;
 }
 
 // Process a min/max spec and update the supplied node accordingly
@@ -343,6 +838,11 @@ done:
     return ++p;         // get past the bracket
 }
 
+// Counts up to this many of a single char, set or class are unrolled into
+// plain copies rather than needing a counter ({0} still needs one)
+#define UNROLL_MAX              16
+#define UNROLLS(n)              ((n)->max && ((n)->max == NO_MAX ? (n)->min : (n)->max) <= UNROLL_MAX)
+
 // Check if a string could be a group identifier, these can be...
 // \1, \10, \21, \200, \{12}, \g1, \g12, \g{15}
 // We assume we have been called with p just after the backslash...
@@ -422,7 +922,7 @@ struct node *optimiser(struct rectx *ctx) {
             case OP_MATCH:
             case OP_MATCHSTR:
             case OP_MATCHSET:
-                if (dotstar) { dotstar->match = n; dotstar = NULL; }
+                if (dotstar) { dotstar->match = OFFSET(dotstar, n); dotstar = NULL; }
                 if (!fstart) {
                     if (n->op == OP_MATCH && n->ch2 == '.') { fstart = NOTUSED; goto parent; }
                     fstart = n;
@@ -436,7 +936,7 @@ struct node *optimiser(struct rectx *ctx) {
             case OP_ANCHOR:
                 // We support specific anchor types for dotstar...
                 if (dotstar) {
-                    if (strchr("AZ^$", n->ch1)) { dotstar->match = n; }
+                    if (strchr("AZ^$", n->ch1)) { dotstar->match = OFFSET(dotstar, n); }
                     dotstar = NULL;
                 }
                 if (!fstart) {
@@ -450,33 +950,34 @@ struct node *optimiser(struct rectx *ctx) {
             case OP_DOTPLUS:
             case OP_DOTSTAR:
                 if (!fstart) fstart = n;
-                dotstar = n;
-                dotstar->match = NULL;
+                n->match = 0;
+                // A stream can't look ahead for the match
+                if (NOT_FLAG(ctx->flags, RELE_STREAM)) dotstar = n;
                 goto parent;
 
             case OP_CONCAT:
-                if (last == n->a) goto leg_b;
-                if (last == n->b) goto parent;
+                if (last == LEG_A(n)) goto leg_b;
+                if (last == LEG_B(n)) goto parent;
                 goto leg_a;
 
             case OP_ALTERNATE:
                 dotstar = NULL;
                 if (fstart) fstart = NOTUSED;
-                if (last == n->a) goto leg_b;
-                if (last == n->b) goto parent;
+                if (last == LEG_A(n)) goto leg_b;
+                if (last == LEG_B(n)) goto parent;
                 goto leg_a;
 
             case OP_QUESTION:
                 if (!fstart) fstart = NOTUSED;
                 dotstar = NULL;
-                if (last == n->b) goto parent;
+                if (last == LEG_B(n)) goto parent;
                 goto leg_b;
 
             // If we're coming up from a plus then we can't continue with the
             // dotstar search as the next match could be a repeat of whatever is below.
             // Going down into a plus is fine, as whatever is below will need to match.
             case OP_PLUS:
-                if (last == n->b) { 
+                if (last == LEG_B(n)) { 
                     if (!fstart) fstart = NOTUSED;
                     dotstar = NULL; 
                     goto parent; 
@@ -487,42 +988,48 @@ struct node *optimiser(struct rectx *ctx) {
             case OP_STAR:
                 dotstar = NULL;
                 if (!fstart) fstart = NOTUSED;
-                if (last == n->b) goto parent;
+                if (last == LEG_B(n)) goto parent;
                 goto leg_b;                
 
             case OP_GROUP:
-                if (n->b == NOTUSED) goto parent;
-                if (last == n->b) goto parent;
+                if (EMPTY_GROUP(n)) goto parent;
+                if (last == LEG_B(n)) goto parent;
                 goto leg_b;
 
             // If we come up then we need to kill the dotstar, but going down is fine
             // if min > 0.
             case OP_MULT:
-                if (last == n->b) { 
+                if (last == LEG_B(n)) { 
                     if (!fstart) fstart = NOTUSED;
                     dotstar = NULL; 
                     goto parent; 
                 }
-                if (n->min == 0) dotstar = NULL;
+                if (n->min == 0) {
+                    if (!fstart) fstart = NOTUSED;      // could match nothing
+                    dotstar = NULL;
+                }
                 goto leg_b;
 
+            // A set has a DONE for each pattern, so keep going for the rest
             case OP_DONE:
-                goto done;
+                if (!ctx->set_count) goto done;
+                dotstar = NULL;
+                goto parent;
 
             default:
                 return NULL;
     
 
 leg_a:      last = n;
-            n = n->a;
+            n = LEG_A(n);
             continue;
 
 leg_b:      last = n;
-            n = n->b;
+            n = LEG_B(n);
             continue;
 
 parent:     last = n;
-            n = n->parent;
+            n = PARENT(n);
             continue;
 
         }
@@ -532,753 +1039,3113 @@ done:       break;
     return fstart;
 }
 
-/**
- * Some utility functions
- */
+// ------------------------------------------------------------------------
+// REQUIRED AND FIRST CHARS
+//
+// Look for a char that every match has to contain, ideally one that doesn't
+// turn up much in normal text, so we can throw away text that doesn't have
+// it with a single memchr(). If we know how far into a match it is then we
+// only need to try starting within reach of each one we find.
+//
+// We also work out the set of chars a match can start with, so we can skip
+// over anything else when looking for a start.
+// ------------------------------------------------------------------------
 
- /**
-  * A fast tolower() implementation, should be branch-free on ARM...
-  */
-static inline unsigned char fast_tolower(unsigned char c)
-{
-    // If 'A' <= c <= 'Z', set bit 5 (0x20), else leave unchanged
-    unsigned char is_upper = (unsigned)((c - 'A') <= ('Z' - 'A'));
-    return c + (is_upper * 32);
+// Defined with the matching code, so we agree with it about what matches
+static int consumes(struct rectx *ctx, struct node *n, int k, int c);
+
+// A rough idea of how rare a char is in normal text, higher is rarer
+static int rarity(unsigned char c) {
+    if (c == ' ') return 0;
+    if (strchr("etaoinsrhl", c)) return 1;
+    if (islower(c)) return 2;
+    if (isupper(c) || isdigit(c)) return 3;
+    if (strchr("\t\r\n.,:;-_/=\"'()", c)) return 4;
+    return 5;
 }
 
-/**
- * My version of strchr that doesn't do the null byte bit!
- */
-static inline char *rele_strchr(char *str, int c) {
-	while (*str) {
-		if (*str == c) return str;
-		str++;
-	}
-	return NULL;
+// Widths are kept as min | max << 16 in the per node scratch space
+#define WIDTH(min, max)     ((uint32_t)(min) | ((uint32_t)(max) << 16))
+#define WMIN(w)             ((w) & 0xffff)
+#define WMAX(w)             ((w) >> 16)
+
+static uint32_t width_add(uint32_t a, uint32_t b) {
+    uint32_t min = WMIN(a) + WMIN(b);
+    uint32_t max = WMAX(a) + WMAX(b);
+    if (min > NO_MAX - 1) min = NO_MAX - 1;
+    if (WMAX(a) == NO_MAX || WMAX(b) == NO_MAX || max > NO_MAX - 1) max = NO_MAX;
+    return WIDTH(min, max);
+}
+
+static uint32_t width_mult(uint32_t w, int min, int max) {
+    uint32_t wmin = WMIN(w) * min;
+    uint32_t wmax = WMAX(w) * max;
+    if (wmin > NO_MAX - 1) wmin = NO_MAX - 1;
+    if (max == NO_MAX || WMAX(w) == NO_MAX || wmax > NO_MAX - 1) wmax = NO_MAX;
+    if (!max) wmax = 0;
+    return WIDTH(wmin, wmax);
 }
 
 /**
- * My version of casecmp that hopefully uses a faster tolower() and is written
- * so that its compiles well on ARM.
+ * See if a match node is on every path through the tree, and if so work out
+ * how far from the start of the match it could be.
  */
-static inline int rele_strncasecmp(const char *s1, const char *s2, int n)
-{
-    while (n--) {
-        unsigned char c1 = fast_tolower((unsigned char)*s1++);
-        unsigned char c2 = fast_tolower((unsigned char)*s2++);
-        if (c1 != c2)
-            return 0;
-    }
-    return 1;
-}
+static int required_at(struct rectx *ctx, uint32_t *width, struct node *n, uint32_t *off) {
+    uint32_t w = WIDTH(0, 0);
 
-// TODO: use a Boyer-Moore-Horspool version of this with a reduced cache
-// can probably get away with 32 bytes.
-static inline char *rele_strifind(const char *haystack, int hlen, const char *needle, int nlen)
-{
-    if (nlen <= 0 || hlen < nlen)
-        return NULL;
+    while (n->parent) {
+        struct node *p = PARENT(n);
 
-    const char *end = haystack + hlen - nlen + 1;
-    for (; haystack < end; haystack++) {
-        if (rele_strncasecmp(haystack, needle, nlen))
-            return (char *)haystack;
+        switch (p->op) {
+            case OP_CONCAT:
+                if (n == LEG_B(p)) w = width_add(w, width[NODE_ID(ctx, LEG_A(p))]);
+                break;
+            case OP_MULT:
+                if (!p->min) return 0;
+                break;
+            case OP_GROUP:
+            case OP_PLUS:
+                break;
+            default:
+                return 0;
+        }
+        n = p;
     }
-    return NULL;
+    *off = w;
+    return 1;
 }
 
 /**
- * Looks for a string of non-special chars that can form a string that we can
- * search for quickly. Returns a new p, and optionally copies into cpy and
- * puts a length in len.
- * 
- * TODO: at the moment this joins quoted strings with normal text which is
- *       great unless there is a + or something after the quoted string
- *       in which case we end up plussing the whole thing.
- *       Easy option would be to treat quoted strings as individual items
- *       then perhaps look for options to merge strings if they are just
- *       concatenated? 
+ * Walk the tree working out the width of each node as we come back up.
  */
-char *find_string(char *p, char *str, int *len, char *ch, int icase, int *error) {
-	char c;			        // single return char
-	int l = 0;		        // len tracking
-	int quoted = 0;	        // are we in a quoted section
-
-	while (*p) {
-		// First deal with the quoted situation...
-		if (quoted) {
-			if (*p == '\\') {
-				if (!p[1]) { SET_ERR(RELE_CE_TRAILBS); goto error; }			// end after a backslash
-				if (p[1] == 'E') { quoted = 0; p += 2; continue; }
-			}
-			goto normal_char;
-		}
-
-		// Do we need to end the current run...
-		// Basic chars first...
-		if (rele_strchr(".+?*|()[]{}^$", p[0])) break;
+static void widths(struct rectx *ctx, uint32_t *width) {
+    struct node *n = ctx->root;
+    struct node *last = NULL;
+    uint32_t w;
 
-		// Then backslash variants...
-		if (*p == '\\') {
-			if (rele_strchr("dDwWsSbBRg{1234567890()", p[1])) break;
-			if (!p[1]) { SET_ERR(RELE_CE_SYNTAX); goto error; }
-		}
+    while (n) {
+        switch (n->op) {
+            case OP_MATCH:
+            case OP_MATCHSET:
+                w = WIDTH(1, 1);
+                goto parent;
 
-		// Ok, at this point we are fairly sure the character is valid, lets
-		// figure out what it is...
-		if (*p == '\\') {
-			switch (p[1]) {
-				case 'Q':		p += 2;			// point at first char of quote
-								quoted = 1;
-								continue;
+            case OP_MATCHSTR:
+                w = WIDTH(n->len, n->len);
+                goto parent;
 
-				case 'x':		c = from_hex(p+2); 
-                                if (c > 128) { SET_ERR(RELE_CE_HEX); goto error; }
-                                p += 2; 
-                                break;
+            case OP_CRLF:
+                w = WIDTH(1, 2);
+                goto parent;
 
-				case 'n':		c = '\n'; break;
-				case 't':		c = '\t'; break;
+            case OP_ANCHOR:
+            case OP_DONE:
+                w = WIDTH(0, 0);
+                goto parent;
 
-                case '.': case '+': case '-': case '*': case '?':
-                                c = p[1]; break;
-				default:	    SET_ERR(RELE_CE_SYNTAX);
-                                goto error;
-			}
-			p += 2;
-		} else {
-normal_char:
-			c = *p++;
-		}
+            case OP_DOTSTAR:
+            case OP_MATCHGRP:
+                w = WIDTH(0, NO_MAX);
+                goto parent;
 
-		// Ok, so we have a candidate char, we need to make sure it's not followed
-		// by something that would cause a problem (+?*), if so we need to roll it back.
-        // If we are a single char though, we need to return that.
-		if (rele_strchr("+?*", *p)) { 
-            if (l) { p--; break; }
-            if (ch) *ch = icase ? fast_tolower(c) : c;
-			l = 1; break; 
-        }
+            case OP_DOTPLUS:
+                w = WIDTH(1, NO_MAX);
+                goto parent;
 
-		// So here we think it's valid...
-		if (ch) *ch = icase ? fast_tolower(c) : c;
-		if (str) *str++ = icase ? fast_tolower(c) : c;
-		l++;
-	}
-    // Make sure we terminated the quote...
-    if (quoted) { SET_ERR(RELE_CE_QUOTE); goto error; }
+            case OP_CONCAT:
+                if (last == LEG_A(n)) goto leg_b;
+                if (last == LEG_B(n)) { w = width_add(width[NODE_ID(ctx, LEG_A(n))], width[NODE_ID(ctx, LEG_B(n))]); goto parent; }
+                goto leg_a;
 
-	if (len) *len = l;
-	return p;
+            case OP_ALTERNATE:
+                if (last == LEG_A(n)) goto leg_b;
+                if (last == LEG_B(n)) {
+                    uint32_t a = width[NODE_ID(ctx, LEG_A(n))], b = width[NODE_ID(ctx, LEG_B(n))];
+                    w = WIDTH(WMIN(a) < WMIN(b) ? WMIN(a) : WMIN(b), WMAX(a) > WMAX(b) ? WMAX(a) : WMAX(b));
+                    goto parent;
+                }
+                goto leg_a;
 
-error:
-	return NULL;
-}
+            case OP_QUESTION:
+            case OP_STAR:
+            case OP_PLUS:
+            case OP_MULT:
+                if (last == LEG_B(n)) {
+                    w = width[NODE_ID(ctx, LEG_B(n))];
+                    if (n->op == OP_QUESTION) w = width_mult(w, 0, 1);
+                    else if (n->op == OP_STAR) w = width_mult(w, 0, NO_MAX);
+                    else if (n->op == OP_PLUS) w = width_mult(w, 1, NO_MAX);
+                    else w = width_mult(w, n->min, n->max);
+                    goto parent;
+                }
+                goto leg_b;
 
+            case OP_GROUP:
+                if (EMPTY_GROUP(n) || !n->b) { w = WIDTH(0, 0); goto parent; }
+                if (last == LEG_B(n)) { w = width[NODE_ID(ctx, LEG_B(n))]; goto parent; }
+                goto leg_b;
 
-// ------------------------------------------------------------------------
-// Dummy (and hopefully fast) version of the compiler that is purely used
-// to measure how many nodes and sets this regex will need and then allocate
-// the memory used for both in a single block.
-// ------------------------------------------------------------------------
-struct rectx *alloc_ctx(char *regex, int flags, int *error) {
-    int matches = 0;
-    int nodes = 0;
-    int sets = 0;
-    int strings = 0;
-    int slen;
+            default:
+                return;
 
-    char *p = regex;
-    while (*p) {
-        // Start out by seeing if we have a string here ....
-        p = find_string(p, NULL, &slen, NULL, 0, error);
-        if (!p) return NULL;
-        if (slen > 1) {
-            matches++;
-            strings += slen;
+leg_a:      last = n;
+            n = LEG_A(n);
             continue;
-        } else if (slen == 1) {
-            matches++;
+
+leg_b:      last = n;
+            n = LEG_B(n);
+            continue;
+
+parent:     width[NODE_ID(ctx, n)] = w;
+            last = n;
+            n = PARENT(n);
             continue;
         }
-        // Otherwise we can deal with everything else...
+    }
+}
 
-        // There's always a match at the end of a given brach, therefore matches
-        // are the key. We will always have one less "splits" (i.e. concat or 
-        // alternate) than we have matches, everything else is always a node.
-        switch (*p) {
-            case '{':
-                p = minmax(p, NULL);
-                if (!p) { SET_ERR(RELE_CE_MINMAX); return NULL; }        // min max error
-                if (*p == '?') p++;         // lazy version
-                nodes++;
-                continue;                   // p is already incrememented
-
-            // These are always a node...
-            case '*':
-            case '+':
-                if (p > regex && p[-1] == '.' && NOT_FLAG(flags, RELE_NEWLINE)) nodes--;     // DOTSTAR/DOTPLUS
-                // Fall through...
+/**
+ * For each literal see if it's a better required char than what we have.
+ */
+static void required(struct rectx *ctx, uint32_t *width) {
+    int icase = ctx->flags & RELE_CASELESS;
+    int best = -1;
+    uint32_t off;
+
+    for (struct node *n = ctx->node_base; n < ctx->nodes; n++) {
+        int len = (n->op == OP_MATCHSTR ? n->len : 1);
+        char *str = (n->op == OP_MATCHSTR ? NODE_STR(n) : &n->ch1);
+
+        if (n->op == OP_MATCH && !n->ch1) continue;
+        if (n->op != OP_MATCH && n->op != OP_MATCHSTR) continue;
+        if (!required_at(ctx, width, n, &off)) continue;
+
+        for (int i=0; i < len; i++) {
+            if (icase && isalpha((unsigned char)str[i])) continue;
+            int r = rarity(str[i]) * 2 + (WMAX(off) != NO_MAX);
+            if (r > best) {
+                uint32_t o = width_add(off, WIDTH(i, i));
+                best = r;
+                ctx->req = str[i];
+                ctx->req_min = WMIN(o);
+                ctx->req_max = WMAX(o);
+            }
+        }
+    }
+}
 
-            case '?':
-                if (p[1] == '?') p++;       // lazy version
-                nodes++;
-                break;
+/**
+ * Work out all the chars a match could start with. We only go into the
+ * second half of a concat if the first half could match nothing, and if
+ * the whole thing can then any position could be a start.
+ */
+static void first_chars(struct rectx *ctx, uint32_t *width) {
+    struct node *n = ctx->root;
+    struct node *last = NULL;
+    uint32_t first[8] = { 0 };
 
-            // An empty group counts as a node and a match...
-            case '(':
-                if (p[1] == '?' && p[2] == ':') {
-                    // Non capturing...
-                    p += 2;
+    if (!WMIN(width[NODE_ID(ctx, ctx->root)])) return;
+
+    while (n) {
+        switch (n->op) {
+            case OP_MATCH:
+            case OP_MATCHSET:
+            case OP_MATCHSTR:
+            case OP_CRLF:
+            case OP_DOTSTAR:
+            case OP_DOTPLUS:
+                for (int c=0; c < 256; c++) {
+                    if (consumes(ctx, n, 0, c)) first[c >> 5] |= (1u << (c & 31));
                 }
-                if (p[1] == '+' || p[1] == '*' || p[1] == '?') { SET_ERR(RELE_CE_SYNTAX); return NULL; }
-                if (p[1] == ')') { matches++; }
-                nodes++;
-                break; 
+                goto parent;
 
-            // Ignore these (alternate we cover via matches)...
-            case '|': case ')':
-                break;
+            case OP_ANCHOR:
+            case OP_DONE:
+                goto parent;
 
-            case '[':
-                p = dummy_set(p);
-                if (!p) { SET_ERR(RELE_CE_SETERR); return NULL; }
-                sets++;
-                matches++;
-                continue;                   // p will already be incremented
+            case OP_CONCAT:
+                if (last == LEG_A(n)) {
+                    if (!WMIN(width[NODE_ID(ctx, LEG_A(n))])) goto leg_b;
+                    goto parent;
+                }
+                if (last == LEG_B(n)) goto parent;
+                goto leg_a;
 
-            // These are effectively matches...
-            case '^': case '$':
-                matches++;
-                break;
+            case OP_ALTERNATE:
+                if (last == LEG_A(n)) goto leg_b;
+                if (last == LEG_B(n)) goto parent;
+                goto leg_a;
 
-            // With the new approach to strings, this can only be a few things
-            // anchors, CRLF, \d, \w etc, dot, and group references
-            case '.':
-                matches++;
-                break;
+            case OP_MULT:
+                if (!n->max) goto parent;
+                // fall through
+            case OP_QUESTION:
+            case OP_STAR:
+            case OP_PLUS:
+            case OP_GROUP:
+                if (EMPTY_GROUP(n) || !n->b) goto parent;
+                if (last == LEG_B(n)) goto parent;
+                goto leg_b;
 
-            case '\\':
-                p++;
-                matches++;
-                if (!*p) { SET_ERR(RELE_CE_SYNTAX); return NULL; }
-                if (is_group(p, NULL, &p, NULL)) {
-                    if (!p) { SET_ERR(RELE_CE_BADGRP); return NULL; }
-                    continue;                   // p will be correct
-                }
-                break;
-                
             default:
-                SET_ERR(RELE_CE_SYNTAX);
-                return NULL;
+                return;         // backreferences could start with anything
+
+leg_a:      last = n;
+            n = LEG_A(n);
+            continue;
+
+leg_b:      last = n;
+            n = LEG_B(n);
+            continue;
+
+parent:     last = n;
+            n = PARENT(n);
+            continue;
         }
-        p++;
     }
 
-    // We need one less splitter than matches
-    int splits = matches - 1;
-    // We also need space for our extra added nodes
-    //nodes += matches + splits + 6;
-    nodes += matches + splits + 3;
+    int count = 0;
+    for (int c=0; c < 256; c++) {
+        if (first[c >> 5] & (1u << (c & 31))) { count++; ctx->first_ch = c; }
+    }
+    if (count > 128) return;        // not worth skipping over the rest
 
-    // Allow an extra char...
-    strings++;
+    scanset_build(&ctx->first, first, 256);
+    ctx->first_count = count;
+}
 
-//    fprintf(stderr, "Matches = %d, Splits = %d, Nodes = %d\n", matches, splits, nodes);
+/**
+ * See if every way through n ends with an end anchor, returns TAIL_END if
+ * they are all \Z, TAIL_EOL if some are $, or 0.
+ */
+static int tail_anchor(struct node *n) {
+    while (n->op == OP_CONCAT || (n->op == OP_GROUP && n->b && !EMPTY_GROUP(n))) n = LEG_B(n);
+
+    if (n->op == OP_ALTERNATE) {
+        int a = tail_anchor(LEG_A(n));
+        int b = tail_anchor(LEG_B(n));
+        if (!a || !b) return 0;
+        return (a > b ? a : b);
+    }
+    if (n->op == OP_ANCHOR && n->ch1 == 'Z') return TAIL_END;
+    if (n->op == OP_ANCHOR && n->ch1 == '$') return TAIL_EOL;
+    return 0;
+}
 
-    struct rectx *ctx = malloc(sizeof(struct rectx) +
-                                (nodes * sizeof(struct node)) + 
-                                (sets * sizeof(struct set)) + strings);
-    if (!ctx) { SET_ERR(RELE_CE_NOMEM); return NULL; }
+/**
+ * See if every way through n starts with \A (or ^ without RELE_NEWLINE)
+ */
+static int head_anchor(struct node *n) {
+    while (n->op == OP_CONCAT || (n->op == OP_GROUP && n->b && !EMPTY_GROUP(n))) {
+        n = (n->op == OP_CONCAT) ? LEG_A(n) : LEG_B(n);
+    }
+    if (n->op == OP_ALTERNATE) return head_anchor(LEG_A(n)) && head_anchor(LEG_B(n));
+    return (n->op == OP_ANCHOR && n->ch1 == 'A');
+}
 
-    memset(ctx, 0, sizeof(struct rectx) +
-                                (nodes * sizeof(struct node)) + 
-                                (sets * sizeof(struct set)) + strings);
+/**
+ * Look at the whole tree for anything that helps us find where a match could
+ * start. The match state per node space is free at this point so we use it
+ * for the widths.
+ */
+void start_hints(struct rectx *ctx) {
+    uint32_t *width = ctx->state->seen;
 
-    ctx->nodes = (struct node *)((void *)ctx + sizeof(struct rectx));
-    ctx->sets = (struct set *)((void *)ctx + (sizeof(struct rectx) + (nodes * sizeof(struct node))));
-    ctx->strings = (void *)ctx->sets + (sets * sizeof(struct set));
-    return ctx;
+    widths(ctx, width);
+    required(ctx, width);
+    first_chars(ctx, width);
+    memset(width, 0, ctx->node_count * sizeof(uint32_t));
+}
+
+/**
+ * Some utility functions
+ */
+
+ /**
+  * A fast tolower() implementation, should be branch-free on ARM...
+  */
+static inline unsigned char fast_tolower(unsigned char c)
+{
+    // If 'A' <= c <= 'Z', set bit 5 (0x20), else leave unchanged
+    unsigned char is_upper = ((unsigned)(c - 'A') <= ('Z' - 'A'));
+    return c + (is_upper * 32);
+}
+
+/**
+ * My version of strchr that doesn't do the null byte bit!
+ */
+static inline char *rele_strchr(char *str, int c) {
+	while (*str) {
+		if (*str == c) return str;
+		str++;
+	}
+	return NULL;
+}
+
+/**
+ * My version of casecmp that hopefully uses a faster tolower() and is written
+ * so that its compiles well on ARM.
+ */
+static inline int rele_strncasecmp(const char *s1, const char *s2, int n)
+{
+    while (n--) {
+        unsigned char c1 = fast_tolower((unsigned char)*s1++);
+        unsigned char c2 = fast_tolower((unsigned char)*s2++);
+        if (c1 != c2)
+            return 0;
+    }
+    return 1;
 }
 
 // ------------------------------------------------------------------------
-// Simple compiler that turns a regular expression into a binary tree
+// STRING SEARCH
+//
+// Each string node has a searcher built at compile time, it sits just
+// before the chars of the string so SEARCH() gets back to it from the node.
+//
+// Short strings use Horspool with a 32 entry shift table indexed by the
+// bottom five bits of the char. That's a lot smaller than 256 entries, and
+// since upper and lower case letters share those bits it works unchanged
+// for caseless matching. Long strings use two-way, which is linear in the
+// worst case and doesn't need any more memory.
+//
+// A small table doesn't skip far on its own, so both of them first use
+// scan_byte() to jump to where the rarest char of the string lines up.
 // ------------------------------------------------------------------------
 
-struct rectx *rele_compile(char *regex, uint32_t flags, int *error) {
-    // First allocate the ctx structure including nodes and sets based on
-    // the regex
-    struct rectx *ctx = alloc_ctx(regex, flags, error);
-    if (!ctx) return NULL;
-    ctx->flags = flags;
-    ctx->groups = 1;
+#define SEARCH_TWOWAY   32          // strings this long or more use two-way
 
-    // Now run through the regex...
-    char        *p = regex;
-    struct node *last = NULL;
-    int         open_groups = 0;
-    int         lazy;
-    int         icase = flags & RELE_CASELESS;
+struct search {
+    int16_t     ell;                // critical factorisation (two-way)
+    uint16_t    per;                // period (two-way)
+    uint16_t    rare;               // offset of the rarest char
+    uint8_t     twoway;
+    uint8_t     periodic;           // two-way needs to remember matches
+    uint8_t     shift[32];          // Horspool shift by (c & 31)
+    char        str[];
+};
 
-    // For string finding...
-    int         slen;
-    char        ch;
+#define SEARCH(n)           ((struct search *)(NODE_STR(n) - offsetof(struct search, str)))
+#define SEARCH_SIZE(len)    ((sizeof(struct search) + (len) + 1) & ~1)
 
-    // Early part of the tree....
-    last = create_node_here(ctx, last, OP_GROUP, NULL, NULL);
-    last->group = 0;
+static inline int same_char(char a, char b, int icase) {
+    if (icase) return fast_tolower(a) == fast_tolower(b);
+    return a == b;
+}
 
-    while (*p) {
-        // Start out by seeing if we have a string here ....
-        p = find_string(p, ctx->strings, &slen, &ch, icase, error);
-        if (!p) goto fail;
-        if (slen > 1) {
-            last = create_node_here(ctx, last, OP_MATCHSTR, NULL, NULL);
-            last->string = ctx->strings;
-            last->len = slen;
-            ctx->strings += slen;
-            continue;
-        } else if (slen == 1) {
-            last = create_node_here(ctx, last, OP_MATCH, NULL, NULL);
-            last->ch1 = icase ? fast_tolower(ch) : ch;
-            continue;
+// Maximal suffix of x, using either ordering of the alphabet, sets the
+// period of the suffix in per.
+static int max_suffix(const char *x, int m, int *per, int rev) {
+    int ms = -1, j = 0, k = 1;
+
+    *per = 1;
+    while (j + k < m) {
+        unsigned char a = x[j + k];
+        unsigned char b = x[ms + k];
+        if (a == b) {
+            if (k != *per) {
+                k++;
+            } else {
+                j += *per;
+                k = 1;
+            }
+        } else if ((a < b) ^ rev) {
+            j += k;
+            k = 1;
+            *per = j - ms;
+        } else {
+            ms = j++;
+            k = *per = 1;
         }
+    }
+    return ms;
+}
 
-        // Otherwise we can deal with everything else...
+// Build the searcher for the string that's already in s->str (lower case
+// if we are caseless)
+static void search_build(struct search *s, int m) {
+    const char *x = s->str;
 
-        // TODO TODO -- (?blah) crashes because of the misplaced ? need to do
-        // some sanity checking in here. Or before!
-        switch (*p) {
-            case '+':
-                if (last && last->op == OP_MATCH && last->ch2 == '.') {
-                    last->op = OP_DOTPLUS;
-                } else {
-                    last = create_node_above(ctx, last, OP_PLUS, NULL, last);
-                }
-                goto star_plus_question;
-            case '*':
-                if (last && last->op == OP_MATCH && last->ch2 == '.') {
-                    last->op = OP_DOTSTAR;
-                } else {
-                    last = create_node_above(ctx, last, OP_STAR, NULL, last);
-                }
-                goto star_plus_question;
-            case '?':
-                last = create_node_above(ctx, last, OP_QUESTION, NULL, last);
-                // fall through
+    int def = (m > 255) ? 255 : m;
+    memset(s->shift, def, sizeof(s->shift));
+    for (int i = 0; i < m - 1; i++) {
+        int sh = m - 1 - i;
+        s->shift[(unsigned char)x[i] & 31] = (sh > 255) ? 255 : sh;
+    }
 
-star_plus_question:
-                lazy = (p[1] == '?' ? 1 : 0);
-                last->lazy = lazy;
-                p += lazy;              // skip the ? if we have it
-                break;
+    s->rare = 0;
+    for (int i = 1; i < m; i++) {
+        if (rarity(x[i]) > rarity(x[s->rare])) s->rare = i;
+    }
 
-            case '|':
-                // Get to the previous thing...
-                while (last->parent && last->parent->op == OP_CONCAT) { last = last->parent; }
-                last = create_node_above(ctx, last, OP_ALTERNATE, last, NULL);
-                break;
+    if (m < SEARCH_TWOWAY) return;
 
-            case '(':
-                last = create_node_here(ctx, last, OP_GROUP, NULL, NULL);
-                open_groups++;
-                if (p[1] == '?' && p[2] && p[2] == ':') {
-                    last->group = NO_GROUP;
-                    p += 2;
-                } else {
-                    last->group = ctx->groups++;
-                }
-                break;
+    int p, q;
+    int i = max_suffix(x, m, &p, 0);
+    int j = max_suffix(x, m, &q, 1);
+    if (i < j) { i = j; p = q; }
 
-            case ')':       // closing a group
-                // Logic is a little complex....
-                // We need to get back to the previous group...
-                //  If we aren't a group, then just to back to the last one.
-                //  If we are a used group, then go back to the prior one
-                //  If we are an empty group, then mark it used, so we go back next time.
-                open_groups--;
-                if (open_groups < 0) { SET_ERR(RELE_CE_BADGRP); goto fail; }
-                if (last && last->op == OP_GROUP && !last->b) {
-                    // This is an empty group, so just mark it NOTUSED
-                    last->b = NOTUSED;
-                    break;
-                }
-                if (last && last->op == OP_GROUP) {
-                    // We need to ensure we go up at least one...
-                    last = last->parent;
-                }
-                while(last && last->op != OP_GROUP) { last = last->parent; }
-                break;
+    s->twoway = 1;
+    s->ell = i;
+    if (memcmp(x, x + p, i + 1) == 0) {
+        s->periodic = 1;
+        s->per = p;
+    } else {
+        s->per = ((i + 1 > m - i - 1) ? i + 1 : m - i - 1) + 1;
+    }
+}
 
-            case '{':
-                last = create_node_above(ctx, last, OP_MULT, NULL, last);
-                p = minmax(p, last);
-                if (!p) { SET_ERR(RELE_CE_MINMAX); goto fail; }
-                if (*p == '?') { 
-                    last->lazy = 1; 
-                    p++; 
+static char *search_twoway(struct search *s, int m, char *p, char *end, int icase) {
+    const char *x = s->str;
+    int ell = s->ell;
+    int r = s->rare;
+    int memory = -1;
+    int i;
+
+    while (end - p >= m) {
+        if (memory < 0) {
+            p = scan_byte(p + r, end - (m - 1 - r), x[r], icase);
+            if (!p) return NULL;
+            p -= r;
+        }
+        i = ((ell > memory) ? ell : memory) + 1;
+        while (i < m && same_char(x[i], p[i], icase)) i++;
+        if (i < m) {
+            p += i - ell;
+            memory = -1;
+            continue;
+        }
+        i = ell;
+        while (i > memory && same_char(x[i], p[i], icase)) i--;
+        if (i <= memory) return p;
+        p += s->per;
+        if (s->periodic) memory = m - s->per - 1;
+    }
+    return NULL;
+}
+
+/**
+ * Find the string from node n at or after p
+ */
+static char *search_find(struct node *n, char *p, char *end, int icase) {
+    struct search *s = SEARCH(n);
+    int m = n->len;
+
+    if (s->twoway) return search_twoway(s, m, p, end, icase);
+
+    const char *x = s->str;
+    char last = x[m - 1];
+    int r = s->rare;
+    while (end - p >= m) {
+        p = scan_byte(p + r, end - (m - 1 - r), x[r], icase);
+        if (!p) return NULL;
+        p -= r;
+
+        unsigned char c = p[m - 1];
+        if (same_char(c, last, icase)) {
+            if (icase ? rele_strncasecmp(p, x, m - 1) : !memcmp(p, x, m - 1)) return p;
+        }
+        p += s->shift[c & 31];
+    }
+    return NULL;
+}
+
+/**
+ * Find a string we only know about at match time (backreferences), these
+ * tend to be short so it's just a scan for the first char.
+ */
+static char *search_plain(const char *x, int m, char *p, char *end, int icase) {
+    if (m <= 0) return p;
+
+    char c = icase ? fast_tolower(x[0]) : x[0];
+    while (end - p >= m) {
+        p = scan_byte(p, end - m + 1, c, icase);
+        if (!p) return NULL;
+        if (icase ? rele_strncasecmp(p, x, m) : !memcmp(p, x, m)) return p;
+        p++;
+    }
+    return NULL;
+}
+
+/**
+ * Looks for a string of non-special chars that can form a string that we can
+ * search for quickly. Returns a new p, and optionally copies into cpy and
+ * puts a length in len.
+ * 
+ * TODO: at the moment this joins quoted strings with normal text which is
+ *       great unless there is a + or something after the quoted string
+ *       in which case we end up plussing the whole thing.
+ *       Easy option would be to treat quoted strings as individual items
+ *       then perhaps look for options to merge strings if they are just
+ *       concatenated? 
+ */
+char *find_string(char *p, char *str, int *len, char *ch, int icase, int *error) {
+	char c;			        // single return char
+	int l = 0;		        // len tracking
+	int quoted = 0;	        // are we in a quoted section
+	char *from;		        // where the current char started
+
+	while (*p) {
+		from = p;
+		// First deal with the quoted situation...
+		if (quoted) {
+			if (*p == '\\') {
+				if (!p[1]) { SET_ERR(RELE_CE_TRAILBS); goto error; }			// end after a backslash
+				if (p[1] == 'E') { quoted = 0; p += 2; continue; }
+			}
+			goto normal_char;
+		}
+
+		// Do we need to end the current run...
+		// Basic chars first...
+		if (rele_strchr(".+?*|()[]{}^$", p[0])) break;
+
+		// Then backslash variants...
+		if (*p == '\\') {
+			if (rele_strchr("dDwWsSbBAZRg{1234567890()", p[1])) break;
+			if (!p[1]) { SET_ERR(RELE_CE_SYNTAX); goto error; }
+		}
+
+		// Ok, at this point we are fairly sure the character is valid, lets
+		// figure out what it is...
+		if (*p == '\\') {
+			switch (p[1]) {
+				case 'Q':		p += 2;			// point at first char of quote
+								quoted = 1;
+								continue;
+
+				case 'x':		c = from_hex(p+2); 
+                                if (c > 128) { SET_ERR(RELE_CE_HEX); goto error; }
+                                p += 2; 
+                                break;
+
+				case 'n':		c = '\n'; break;
+				case 't':		c = '\t'; break;
+
+                case '.': case '+': case '-': case '*': case '?':
+                                c = p[1]; break;
+				default:	    SET_ERR(RELE_CE_SYNTAX);
+                                goto error;
+			}
+			p += 2;
+		} else {
+normal_char:
+			c = *p++;
+		}
+
+		// Ok, so we have a candidate char, we need to make sure it's not followed
+		// by something that would cause a problem (+?*{), if so we need to roll it back.
+        // If we are a single char though, we need to return that.
+		if (rele_strchr("+?*", *p) || (*p == '{' && !quoted)) { 
+            if (l) { p = from; break; }
+            if (ch) *ch = icase ? fast_tolower(c) : c;
+			l = 1; break; 
+        }
+
+		// So here we think it's valid...
+		if (ch) *ch = icase ? fast_tolower(c) : c;
+		if (str) *str++ = icase ? fast_tolower(c) : c;
+		l++;
+	}
+    // Make sure we terminated the quote...
+    if (quoted) { SET_ERR(RELE_CE_QUOTE); goto error; }
+
+	if (len) *len = l;
+	return p;
+
+error:
+	return NULL;
+}
+
+
+struct dfa;
+static int dfa_layout(struct dfa *d, int nodes, int items);
+static void dfa_classes(struct rectx *ctx);
+
+// Setup the per node arrays and the task slab that follow a match state,
+// memory must be zeroed. All of the slab goes onto the free list.
+static void state_init(struct rematch *m, struct rectx *ctx, int nodes) {
+    m->ctx = ctx;
+    m->waiter = (struct task **)((void *)m + sizeof(struct rematch));
+    m->seen = (uint32_t *)(m->waiter + nodes);
+#ifdef RELE_HEATMAP
+    m->heat = (struct heat *)(m->seen + nodes);
+#endif
+
+    m->slab = (void *)m + STATE_SIZE(nodes, 0, 0, 0);
+    m->slab_end = m->slab + (ctx->slab_tasks * ctx->task_size);
+    for (int i = ctx->slab_tasks - 1; i >= 0; i--) {
+        struct task *t = (struct task *)(m->slab + (i * ctx->task_size));
+        t->next = m->free_list;
+        m->free_list = t;
+    }
+
+    if (ctx->dfa_items) {
+        m->dfa = (struct dfa *)m->slab_end;
+        int size = dfa_layout(m->dfa, nodes, ctx->dfa_items);
+        if (ctx->rdfa) {
+            m->rdfa = (struct dfa *)((void *)m->dfa + size);
+            dfa_layout(m->rdfa, nodes, ctx->dfa_items);
+        }
+    }
+}
+
+// ------------------------------------------------------------------------
+// Dummy (and hopefully fast) version of the compiler that is purely used
+// to measure how many nodes and sets this regex will need and then allocate
+// the memory used for both in a single block.
+// ------------------------------------------------------------------------
+struct rectx *alloc_ctx(char **regexes, int set, int flags, int *error) {
+    char *regex = regexes[0];
+    int matches = 0;
+    int nodes = 0;
+    int sets = 0;
+    int strings = 0;
+    int searches = 0;
+    int groups = 1;
+    int counts = 1;
+    int depth = 0;
+    int loops = 0;
+    int ends = 0;
+    int dfa = NOT_FLAG(flags, RELE_NO_DFA) && !set;
+    int slen;
+    int leaf = 0;
+
+    // A set is all of its patterns plus a group, DONE, concat and alternate
+    // to join each one in
+    for (int r = 0; r < (set ? set : 1); r++) {
+        char *p = regex = regexes[r];
+        if (set) nodes += 4;
+        leaf = 0;
+        while (*p) {
+            // Start out by seeing if we have a string here ....
+            p = find_string(p, NULL, &slen, NULL, 0, error);
+            if (!p) return NULL;
+            if (slen) leaf = (slen == 1);
+            if (slen > 1 && HAS_FLAG(flags, RELE_STREAM)) {
+                // A char at a time, but it still gets built in the strings
+                matches += slen;
+                strings += slen;
+                continue;
+            } else if (slen > 1) {
+                matches++;
+                strings += slen;
+                searches++;
+                if (slen > DFA_MAX_STRING) dfa = 0;
+                continue;
+            } else if (slen == 1) {
+                matches++;
+                continue;
+            }
+            // Otherwise we can deal with everything else...
+
+            // There's always a match at the end of a given brach, therefore matches
+            // are the key. We will always have one less "splits" (i.e. concat or 
+            // alternate) than we have matches, everything else is always a node.
+            int prev = leaf;
+            leaf = 0;
+            switch (*p) {
+                case '{': {
+                    struct node mm;
+                    p = minmax(p, &mm);
+                    if (!p) { SET_ERR(RELE_CE_MINMAX); return NULL; }        // min max error
+                    if (*p == '?') p++;         // lazy version
+                    nodes++;
+
+                    // A small count of a single char, set or class is copied
+                    // out, each copy is a match and the optional ones need a
+                    // ? each (or a single + or * if there's no max)
+                    if (prev && UNROLLS(&mm)) {
+                        int copies = (mm.max == NO_MAX ? mm.min : mm.max);
+                        if (copies > 1) matches += copies - 1;
+                        nodes += (mm.max == NO_MAX ? 1 : mm.max - mm.min);
+                        leaf = (mm.max == 1 && mm.min == 1);    // x{1} is just x
+                        if (mm.max == NO_MAX) loops++;
+                        continue;
+                    }
+
+                    // Otherwise it's a counter, and each one could be nested
+                    // inside the others.
+                    depth++;
+                    loops++;
+
+                    // Each distinct counter value could need its own task, above
+                    // min an open ended count is all the same.
+                    if (mm.max == NO_MAX) mm.max = mm.min + 1;
+                    if (counts < MAX_SLAB_TASKS) counts *= mm.max + 1;
+                    dfa = 0;                    // the DFA doesn't do counters
+                    continue;                   // p is already incrememented
                 }
-                continue;           // p is already incremented
 
+                // These are always a node...
+                case '*':
+                case '+':
+                    if (p > regex && p[-1] == '.' && NOT_FLAG(flags, RELE_NEWLINE)) nodes--;     // DOTSTAR/DOTPLUS
+                    loops++;
+                    // Fall through...
 
-            case '^':
-                last = create_node_here(ctx, last, OP_ANCHOR, NULL, NULL);
-                last->ch1 = (flags & RELE_NEWLINE) ? '^' : 'A';
-                break;
+                case '?':
+                    if (p[1] == '?') p++;       // lazy version
+                    nodes++;
+                    break;
 
-            case '$':
-                last = create_node_here(ctx, last, OP_ANCHOR, NULL, NULL);
-                last->ch1 = (flags & RELE_NEWLINE) ? '$' : 'Z';
-               break;
+                // An empty group counts as a node and a match...
+                case '(':
+                    if (p[1] == '?' && p[2] == ':') {
+                        // Non capturing...
+                        p += 2;
+                    } else if (!set) {
+                        groups++;       // a set only has group 0
+                    }
+                    if (p[1] == '+' || p[1] == '*' || p[1] == '?') { SET_ERR(RELE_CE_SYNTAX); return NULL; }
+                    if (p[1] == ')') { matches++; }
+                    nodes++;
+                    break; 
 
-            case '[':
-                last = create_node_here(ctx, last, OP_MATCHSET, NULL, NULL);
-                p = build_set(ctx, p, last);
-                if (!p) { SET_ERR(RELE_CE_SETERR); goto fail; }
-                continue;                   // p will already be incremented
+                // Ignore these (alternate we cover via matches)...
+                case '|': case ')':
+                    break;
+
+                case '[':
+                    p = dummy_set(p);
+                    if (!p) { SET_ERR(RELE_CE_SETERR); return NULL; }
+                    sets++;
+                    matches++;
+                    leaf = 1;
+                    continue;                   // p will already be incremented
+
+                // These are effectively matches...
+                case '^': case '$':
+                    if (*p == '$') ends = 1;
+                    matches++;
+                    break;
+
+                // With the new approach to strings, this can only be a few things
+                // anchors, CRLF, \d, \w etc, dot, and group references
+                case '.':
+                    matches++;
+                    leaf = 1;
+                    break;
+
+                case '\\':
+                    p++;
+                    matches++;
+                    if (!*p) { SET_ERR(RELE_CE_SYNTAX); return NULL; }
+                    if (is_group(p, NULL, &p, NULL)) {
+                        if (!p) { SET_ERR(RELE_CE_BADGRP); return NULL; }
+                        if (HAS_FLAG(flags, RELE_STREAM)) { SET_ERR(RELE_CE_STREAM); return NULL; }
+                        if (set) { SET_ERR(RELE_CE_SET); return NULL; }
+                        dfa = 0;                    // or backreferences
+                        counts = MAX_SLAB_TASKS;    // tasks only dedupe with the same groups
+                        continue;                   // p will be correct
+                    }
+                    leaf = !rele_strchr("RABZbB", *p);
+                    if (*p == 'Z') ends = 1;
+                    break;
+                    
+                default:
+                    SET_ERR(RELE_CE_SYNTAX);
+                    return NULL;
+            }
+            p++;
+        }
+    }
+
+    // We need one less splitter than matches
+    int splits = matches - 1;
+    // We also need space for our extra added nodes
+    //nodes += matches + splits + 6;
+    nodes += matches + splits + 3;
+    if (nodes > MAX_NODES) { SET_ERR(RELE_CE_TOOBIG); return NULL; }
+
+    // Allow an extra char...
+    strings++;
+
+    // Each string has a searcher in front of it, and the last one we look
+    // at might not be used.
+    int sbytes = strings + (searches + 1) * (sizeof(struct search) + 1);
+
+    // Live tasks are deduplicated by node, so at any point we can have one
+    // per node from the last position and one from this one, plus one for
+    // each char of a string that's still waiting. Counters multiply that, but
+    // they only get up to MAX_SLAB_TASKS more.
+    if (counts > MAX_SLAB_TASKS) counts = MAX_SLAB_TASKS;
+    int tasks = 2 * (nodes + strings) + 2;
+    int extra = tasks * (counts - 1);
+    tasks += (extra < MAX_SLAB_TASKS ? extra : MAX_SLAB_TASKS);
+    int tsize = TASK_SIZE(groups, loops, depth);
+
+    // A DFA state can't have more items than one per direction on each node
+    // plus one per char of our strings.
+    int items = 0;
+    if (nodes > DFA_MAX_NODES) dfa = 0;
+    if (dfa) items = (4 * nodes) + strings;
+
+    // The default match state goes straight after the context, it needs a
+    // few slots for every node, the task slab and the DFA.
+    // If there's an end anchor anywhere then make room for a reverse DFA as
+    // well, finish() works out if the pattern really ends with one.
+    int rdfa = dfa && ends;
+
+    int dsize = (dfa ? dfa_layout(NULL, nodes, items) * (rdfa ? 2 : 1) : 0);
+    int state = ALIGN_PTR(STATE_SIZE(nodes, tasks, tsize, dsize));
+
+    int size = sizeof(struct rectx) + state +
+                                (nodes * sizeof(struct node)) + 
+                                (sets * sizeof(struct set)) + sbytes +
+                                (dfa ? 256 : 0);
 
+    struct rectx *ctx = malloc(size);
+    if (!ctx) { SET_ERR(RELE_CE_NOMEM); return NULL; }
+
+    memset(ctx, 0, size);
+
+    ctx->size = size;
+    ctx->slab_tasks = tasks;
+    ctx->task_size = tsize;
+    ctx->depth = depth;
+    ctx->loops = loops;
+    ctx->dfa_items = items;
+    ctx->rdfa = rdfa;
+    ctx->state = (struct rematch *)((void *)ctx + sizeof(struct rectx));
+    state_init(ctx->state, ctx, nodes);
+    ctx->nodes = (struct node *)((void *)ctx->state + state);
+    ctx->node_base = ctx->nodes;
+    ctx->sets = (struct set *)((void *)ctx->nodes + (nodes * sizeof(struct node)));
+    ctx->strings = (void *)ctx->sets + (sets * sizeof(struct set));
+    if (dfa) ctx->bclass = (uint8_t *)ctx->strings + sbytes;
+    return ctx;
+}
+
+// ------------------------------------------------------------------------
+// Simple compiler that turns a regular expression into a binary tree
+// ------------------------------------------------------------------------
+
+/**
+ * Add a copy of a single char, set or class match after last.
+ */
+static struct node *copy_leaf(struct rectx *ctx, struct node *last, struct node *leaf) {
+    struct node *n = create_node_here(ctx, last, leaf->op, NULL, NULL);
+    if (leaf->op == OP_MATCHSET) {
+        n->set = BYTE_OFFSET(n, NODE_SET(leaf));
+    } else {
+        n->ch1 = leaf->ch1;
+        n->ch2 = leaf->ch2;
+        n->cls = leaf->cls;
+    }
+    return n;
+}
+
+/**
+ * Turn leaf{min,max} into plain copies of the leaf, so x{2,4} becomes
+ * xx(x(x)?)? and x{2,} becomes xx+, which the DFA and JIT can both do.
+ * Returns whatever has taken the place of leaf in the tree.
+ */
+static struct node *unroll(struct rectx *ctx, struct node *leaf, int min, int max, int lazy) {
+    struct node *up = PARENT(leaf);
+    struct node *n = leaf;
+    int count = (max == NO_MAX ? min : max);
+
+    for (int i = 1; i <= count; i++) {
+        if (i > 1) n = copy_leaf(ctx, n, leaf);
+        if (i == count && max == NO_MAX) {
+            n = create_node_above(ctx, n, OP_PLUS, NULL, n);
+            n->lazy = lazy;
+        } else if (i > min) {
+            // Nested so that later copies are only tried if this one matched
+            create_node_above(ctx, n, OP_QUESTION, NULL, n)->lazy = lazy;
+        }
+    }
+    if (!count) {
+        n = create_node_above(ctx, n, OP_STAR, NULL, n);
+        n->lazy = lazy;
+    }
+
+    // Anything that follows has to go after all of it
+    while (PARENT(n) != up) n = PARENT(n);
+    return n;
+}
+
+/**
+ * Build the tree for one regex below last (which is a group), returns the
+ * last node created or NULL if there was an error.
+ */
+static struct node *parse(struct rectx *ctx, char *regex, struct node *last, int *error) {
+    char        *p = regex;
+    int         flags = ctx->flags;
+    int         open_groups = 0;
+    int         lazy;
+    int         icase = flags & RELE_CASELESS;
+
+    // For string finding...
+    int         slen;
+    char        ch;
+
+    while (*p) {
+        // Start out by seeing if we have a string here ....
+        struct search *search = (struct search *)ctx->strings;
+        p = find_string(p, search->str, &slen, &ch, icase, error);
+        if (!p) return NULL;
+        if (slen > 1 && HAS_FLAG(flags, RELE_STREAM)) {
+            // A stream can't look ahead for a whole string
+            for (int i = 0; i < slen; i++) {
+                last = create_node_here(ctx, last, OP_MATCH, NULL, NULL);
+                last->ch1 = search->str[i];
+            }
+            continue;
+        } else if (slen > 1) {
+            last = create_node_here(ctx, last, OP_MATCHSTR, NULL, NULL);
+            last->string = BYTE_OFFSET(last, search->str);
+            last->len = slen;
+            search_build(search, slen);
+            ctx->strings += SEARCH_SIZE(slen);
+            continue;
+        } else if (slen == 1) {
+            last = create_node_here(ctx, last, OP_MATCH, NULL, NULL);
+            last->ch1 = icase ? fast_tolower(ch) : ch;
+            continue;
+        }
+
+        // Otherwise we can deal with everything else...
+
+        // TODO TODO -- (?blah) crashes because of the misplaced ? need to do
+        // some sanity checking in here. Or before!
+        switch (*p) {
+            case '+':
+                if (last && last->op == OP_MATCH && last->ch2 == '.') {
+                    last->op = OP_DOTPLUS;
+                } else {
+                    last = create_node_above(ctx, last, OP_PLUS, NULL, last);
+                }
+                goto star_plus_question;
+            case '*':
+                if (last && last->op == OP_MATCH && last->ch2 == '.') {
+                    last->op = OP_DOTSTAR;
+                } else {
+                    last = create_node_above(ctx, last, OP_STAR, NULL, last);
+                }
+                goto star_plus_question;
+            case '?':
+                last = create_node_above(ctx, last, OP_QUESTION, NULL, last);
+                // fall through
+
+star_plus_question:
+                lazy = (p[1] == '?' ? 1 : 0);
+                last->lazy = lazy;
+                p += lazy;              // skip the ? if we have it
+                break;
+
+            case '|':
+                // Get to the previous thing...
+                while (last->parent && PARENT(last)->op == OP_CONCAT) { last = PARENT(last); }
+                last = create_node_above(ctx, last, OP_ALTERNATE, last, NULL);
+                break;
+
+            case '(':
+                last = create_node_here(ctx, last, OP_GROUP, NULL, NULL);
+                open_groups++;
+                if (p[1] == '?' && p[2] && p[2] == ':') {
+                    last->group = NO_GROUP;
+                    p += 2;
+                } else {
+                    last->group = (ctx->set_count ? NO_GROUP : ctx->groups++);
+                }
+                break;
+
+            case ')':       // closing a group
+                // Logic is a little complex....
+                // We need to get back to the previous group...
+                //  If we aren't a group, then just to back to the last one.
+                //  If we are a used group, then go back to the prior one
+                //  If we are an empty group, then mark it used, so we go back next time.
+                open_groups--;
+                if (open_groups < 0) { SET_ERR(RELE_CE_BADGRP); return NULL; }
+                if (last && last->op == OP_GROUP && !last->b) {
+                    // This is an empty group, so just mark it empty
+                    last->b = EMPTY_LEG;
+                    break;
+                }
+                if (last && last->op == OP_GROUP) {
+                    // We need to ensure we go up at least one...
+                    last = PARENT(last);
+                }
+                while(last && last->op != OP_GROUP) { last = PARENT(last); }
+                break;
+
+            case '{': {
+                struct node mm;
+                p = minmax(p, &mm);
+                if (!p) { SET_ERR(RELE_CE_MINMAX); return NULL; }
+                lazy = (*p == '?');
+                p += lazy;
+
+                if (last && (last->op == OP_MATCH || last->op == OP_MATCHSET) && UNROLLS(&mm)) {
+                    last = unroll(ctx, last, mm.min, mm.max, lazy);
+                    continue;
+                }
+                last = create_node_above(ctx, last, OP_MULT, NULL, last);
+                ctx->has |= HAS_MULT;
+                last->min = mm.min;
+                last->max = mm.max;
+                last->lazy = lazy;
+                continue;           // p is already incremented
+            }
+
+
+            case '^':
+                last = create_node_here(ctx, last, OP_ANCHOR, NULL, NULL);
+                last->ch1 = (flags & RELE_NEWLINE) ? '^' : 'A';
+                break;
+
+            case '$':
+                last = create_node_here(ctx, last, OP_ANCHOR, NULL, NULL);
+                last->ch1 = (flags & RELE_NEWLINE) ? '$' : 'Z';
+               break;
+
+            case '[':
+                last = create_node_here(ctx, last, OP_MATCHSET, NULL, NULL);
+                p = build_set(ctx, p, last);
+                if (!p) { SET_ERR(RELE_CE_SETERR); return NULL; }
+                continue;                   // p will already be incremented
+
+
+            // With the new approach to strings, this can only be a few things
+            // anchors, CRLF, \d, \w etc, dot, and group references
+            case '.':
+                last = create_node_here(ctx, last, OP_MATCH, NULL, NULL);
+                last->ch2 = (flags & RELE_NEWLINE) ? ',' : '.';
+                last->cls = class_bit(last->ch2);
+                break;
+
+            case '\\':
+                p++;
+                last = create_node_here(ctx, last, OP_MATCH, NULL, NULL);
+                if (is_group(p, &(last->mgrp), &p, NULL)) {
+                        if (!p || (last->mgrp >= ctx->groups)) { SET_ERR(RELE_CE_BADGRP); return NULL; }
+                        last->op = OP_MATCHGRP;
+                        ctx->has |= HAS_BACKREF;
+                        continue;                   // p will be correct
+                }
+                switch (*p) {
+                    case 0:     SET_ERR(RELE_CE_SYNTAX); return NULL;
+                    case 'R':   last->op = OP_CRLF; break;
+                    case 'A':
+                    case 'Z':
+                    case 'b':
+                    case 'B':   last->op = OP_ANCHOR; last->ch1 = *p; break;
+                    case '(':
+                    case ')':
+                    case '{':   last->ch1 = *p; break;
+                    default:    last->ch2 = *p;         // \w \d etc.
+                                last->cls = class_bit(*p);
+                                if (!last->cls) { SET_ERR(RELE_CE_SYNTAX); return NULL; }
+                                break;
+                }
+                break;
+            
+            default:
+                SET_ERR(RELE_CE_SYNTAX);
+                return NULL;   
+        }
+        p++;
+    }
+    // Quick error check on groups...
+    if (open_groups != 0) { SET_ERR(RELE_CE_BADGRP); return NULL; }
+    return last;
+}
+
+/**
+ * Once the tree is built work out everything that helps us match it.
+ */
+static struct rectx *finish(struct rectx *ctx) {
+    int flags = ctx->flags;
+
+    ctx->node_count = NODE_ID(ctx, ctx->nodes);
+
+    // Run the optimisation check...
+    ctx->fast_start = optimiser(ctx);
+    if (flags & RELE_NO_FASTSTART) ctx->fast_start = NULL;
+    else start_hints(ctx);
+
+    // We only need to know how it ends if we have room for a reverse DFA,
+    // and we only use one if every way through ends with an anchor
+    if (ctx->rdfa) ctx->tail = tail_anchor(LEG_A(ctx->root));
+    if (!ctx->tail) { ctx->rdfa = 0; ctx->state->rdfa = NULL; }
+    ctx->anchored = head_anchor(ctx->root);
+
+    // If we can use the DFA then work out the byte classes it needs...
+    if (ctx->bclass) dfa_classes(ctx);
+
+    // Native code if it was asked for, we just carry on without it if it
+    // can't be done
+    if (flags & RELE_NATIVE) ctx->jit = jit_build(ctx);
+
+    // And we're done...
+    return ctx;
+}
+
+struct rectx *rele_compile(char *regex, uint32_t flags, int *error) {
+    // First allocate the ctx structure including nodes and sets based on
+    // the regex
+    struct rectx *ctx = alloc_ctx(&regex, 0, flags, error);
+    if (!ctx) return NULL;
+    ctx->flags = flags;
+    ctx->groups = 1;
+
+    // Early part of the tree....
+    struct node *last = create_node_here(ctx, NULL, OP_GROUP, NULL, NULL);
+    last->group = 0;
+
+    if (!parse(ctx, regex, last, error)) goto fail;
+
+    // Postprocessing just needs to ensure there's a DONE in the right place
+    // We put it after the group b node to save one more parent move.
+    create_node_here(ctx, ctx->root, OP_DONE, NULL, NULL);
+    return finish(ctx);
+
+fail:
+    free(ctx);
+    return NULL;
+}
+
+/**
+ * Compile a set of patterns that can all be matched in one pass, see
+ * rele_exec_set(). Each pattern sits in its own group with its own DONE
+ * and they are joined with alternates under group 0, so the nodes, sets
+ * and strings for all of them share one block.
+ *
+ * Groups in the patterns don't capture, so backreferences aren't allowed.
+ */
+struct rectx *rele_compile_set(char **regex, int count, uint32_t flags, int *error) {
+    if (count < 1 || count > 0xffff) { SET_ERR(RELE_CE_SET); return NULL; }
+
+    struct rectx *ctx = alloc_ctx(regex, count, flags, error);
+    if (!ctx) return NULL;
+    ctx->flags = flags;
+    ctx->groups = 1;
+    ctx->set_count = count;
+
+    struct node *last = create_node_here(ctx, NULL, OP_GROUP, NULL, NULL);
+    last->group = 0;
+
+    struct node *prev = NULL;
+    for (int i = 0; i < count; i++) {
+        // Everything after the first is the b leg of an alternate
+        struct node *at = (prev ? create_node_above(ctx, prev, OP_ALTERNATE, prev, NULL) : last);
+        struct node *g = create_node_here(ctx, at, OP_GROUP, NULL, NULL);
+        g->group = NO_GROUP;
+
+        if (!parse(ctx, regex[i], g, error)) goto fail;
+
+        struct node *done = create_node_here(ctx, g, OP_DONE, NULL, NULL);
+        done->id = i;
+        prev = PARENT(done);
+    }
+    return finish(ctx);
+
+fail:
+    free(ctx);
+    return NULL;
+}
+
+// ------------------------------------------------------------------------
+// SAVING AND LOADING
+//
+// The nodes, sets and strings only refer to each other with offsets, so a
+// compiled regex can be saved as a blob and matched from wherever it ends up
+// (flash or a read-only mmap) without being copied. Only the context and its
+// default match state need to be in RAM.
+// ------------------------------------------------------------------------
+
+#define BLOB_ENDIAN         0x01020304
+#define BLOB_VERSION        5
+
+// The blob starts with this, the nodes, sets and strings follow it exactly as
+// they were in the context, then the byte classes if we have a DFA.
+struct blob {
+    char            magic[4];       // "RELE"
+    uint32_t        endian;         // BLOB_ENDIAN in the byte order it was made in
+    uint16_t        version;
+    uint8_t         node_size;      // the layout has to be the same as ours
+    uint8_t         set_size;
+    uint32_t        size;           // of the whole blob
+    uint32_t        check;          // blob_check() of the rest of it
+    uint32_t        region;         // bytes of nodes, sets and strings
+    uint32_t        bclass;         // where the byte classes are (0 if none)
+
+    int32_t         root;           // node ids
+    int32_t         fast_start;     // -1 if there isn't one
+    int32_t         node_count;
+    int32_t         slab_tasks;
+    int32_t         dfa_items;
+
+    struct scanset  first;
+    uint16_t        first_count;
+    uint16_t        nclasses;
+    uint16_t        req_min;
+    uint16_t        req_max;
+    uint16_t        flags;
+    uint16_t        set_count;
+    uint16_t        depth;
+    uint16_t        loops;
+    char            first_ch;
+    char            req;
+    uint8_t         groups;
+    uint8_t         has;
+    uint8_t         dfa_context;
+    uint8_t         rdfa;
+    uint8_t         tail;
+    uint8_t         anchored;
+};
+
+// FNV-1a over the whole blob except check itself. Nothing in the nodes, sets
+// or strings is checked when they are used, so any change to them (or to the
+// sizes in the header) has to be caught here.
+static uint32_t blob_check(const struct blob *b) {
+    const uint8_t *p = (const uint8_t *)b;
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < b->size; i++) {
+        if (i == offsetof(struct blob, check)) i += sizeof(b->check);
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Save a compiled regex into buf, returns the size it needs. If buf is NULL
+ * or len isn't big enough nothing is written, so call it with NULL first to
+ * find out how much space to give it.
+ */
+int rele_serialize(struct rectx *ctx, void *buf, int len) {
+    uint32_t region = (char *)ctx->strings - (char *)ctx->node_base;
+    uint32_t size = sizeof(struct blob) + region;
+    uint32_t bclass = 0;
+
+    if (ctx->bclass) {
+        bclass = (size + 3) & ~3;
+        size = bclass + 256;
+    }
+    if (!buf || len < (int)size) return size;
+
+    struct blob *b = (struct blob *)buf;
+    memset(b, 0, size);
+    memcpy(b->magic, "RELE", 4);
+    b->endian = BLOB_ENDIAN;
+    b->version = BLOB_VERSION;
+    b->node_size = sizeof(struct node);
+    b->set_size = sizeof(struct set);
+    b->size = size;
+    b->region = region;
+    b->bclass = bclass;
+
+    b->root = NODE_ID(ctx, ctx->root);
+    b->fast_start = (ctx->fast_start ? NODE_ID(ctx, ctx->fast_start) : -1);
+    b->node_count = ctx->node_count;
+    b->slab_tasks = ctx->slab_tasks;
+    b->dfa_items = ctx->dfa_items;
+
+    b->first = ctx->first;
+    b->first_count = ctx->first_count;
+    b->nclasses = ctx->nclasses;
+    b->req_min = ctx->req_min;
+    b->req_max = ctx->req_max;
+    b->flags = ctx->flags;
+    b->set_count = ctx->set_count;
+    b->depth = ctx->depth;
+    b->loops = ctx->loops;
+    b->first_ch = ctx->first_ch;
+    b->req = ctx->req;
+    b->groups = ctx->groups;
+    b->has = ctx->has;
+    b->dfa_context = ctx->dfa_context;
+    b->rdfa = ctx->rdfa;
+    b->tail = ctx->tail;
+    b->anchored = ctx->anchored;
+
+    memcpy((char *)b + sizeof(struct blob), ctx->node_base, region);
+    if (bclass) memcpy((char *)b + bclass, ctx->bclass, 256);
+    b->check = blob_check(b);
+    return size;
+}
+
+/**
+ * Use a blob from rele_serialize() as a compiled regex. The blob isn't
+ * copied, so it needs to stay where it is (and 4 byte aligned) until
+ * rele_free() is called, it is never written to. One that has changed since
+ * it was saved gives RELE_CE_BLOB.
+ */
+struct rectx *rele_load(const void *blob, int len, int *error) {
+    const struct blob *b = (const struct blob *)blob;
+
+    if (((uintptr_t)blob & 3) || len < (int)sizeof(struct blob)) goto bad;
+    if (memcmp(b->magic, "RELE", 4) != 0 || b->endian != BLOB_ENDIAN) goto bad;
+    if (b->version != BLOB_VERSION || b->node_size != sizeof(struct node) ||
+                                      b->set_size != sizeof(struct set)) goto bad;
+    if (b->size > (uint32_t)len || sizeof(struct blob) + b->region > b->size) goto bad;
+    if (b->check != blob_check(b)) goto bad;
+    if (b->node_count < 1 || b->node_count * sizeof(struct node) > b->region) goto bad;
+    if (b->root < 0 || b->root >= b->node_count || b->fast_start >= b->node_count) goto bad;
+    if (b->bclass && b->bclass + 256 > b->size) goto bad;
+
+    int dfa = (b->dfa_items ? dfa_layout(NULL, b->node_count, b->dfa_items) * (b->rdfa ? 2 : 1) : 0);
+    int tsize = TASK_SIZE(b->groups, b->loops, b->depth);
+    int state = ALIGN_PTR(STATE_SIZE(b->node_count, b->slab_tasks, tsize, dfa));
+
+    struct rectx *ctx = malloc(sizeof(struct rectx) + state);
+    if (!ctx) { SET_ERR(RELE_CE_NOMEM); return NULL; }
+    memset(ctx, 0, sizeof(struct rectx) + state);
+    ctx->size = sizeof(struct rectx) + state;
+
+    // Nothing writes to the nodes once they are compiled, so they can stay
+    // in the blob
+    ctx->node_base = (struct node *)((char *)b + sizeof(struct blob));
+    ctx->node_count = b->node_count;
+    ctx->nodes = ctx->node_base + ctx->node_count;
+    ctx->root = ctx->node_base + b->root;
+    if (b->fast_start >= 0) ctx->fast_start = ctx->node_base + b->fast_start;
+    if (b->bclass) ctx->bclass = (uint8_t *)b + b->bclass;
+    ctx->strings = (char *)ctx->node_base + b->region;    // the end, for rele_serialize()
+
+    ctx->slab_tasks = b->slab_tasks;
+    ctx->task_size = tsize;
+    ctx->depth = b->depth;
+    ctx->loops = b->loops;
+    ctx->dfa_items = b->dfa_items;
+    ctx->first = b->first;
+    ctx->first_count = b->first_count;
+    ctx->nclasses = b->nclasses;
+    ctx->req_min = b->req_min;
+    ctx->req_max = b->req_max;
+    ctx->flags = b->flags;
+    ctx->set_count = b->set_count;
+    ctx->first_ch = b->first_ch;
+    ctx->req = b->req;
+    ctx->groups = b->groups;
+    ctx->has = b->has;
+    ctx->dfa_context = b->dfa_context;
+    ctx->rdfa = b->rdfa;
+    ctx->tail = b->tail;
+    ctx->anchored = b->anchored;
+
+    ctx->state = (struct rematch *)((void *)ctx + sizeof(struct rectx));
+    state_init(ctx->state, ctx, ctx->node_count);
+    if (HAS_FLAG(ctx->flags, RELE_NATIVE)) ctx->jit = jit_build(ctx);
+    return ctx;
+
+bad:
+    SET_ERR(RELE_CE_BLOB);
+    return NULL;
+}
+
+// ------------------------------------------------------------------------
+// CACHE
+//
+// rele_cache_compile() keeps compiled regexes in a hash table keyed on the
+// pattern and flags and hands out shared references to them. A lookup doesn't
+// take the lock, it counts itself in readers, probes the table and takes a
+// reference with a compare and swap (which fails if the entry is on its way
+// out). Adding, evicting and growing the table are done under a spinlock, the
+// compile itself isn't.
+//
+// Nothing that a lookup could be looking at is freed while there are any
+// readers, it goes on a retired list until a writer sees none. The table and
+// the readers count are all sequentially consistent so a writer that sees no
+// readers knows they can't have seen anything it took out before that.
+//
+// Eviction is close to least recently used, each hit stamps the entry with a
+// tick and we evict the oldest of the next few entries round the table from
+// where the last eviction stopped, rather than looking at all of them with
+// the lock held.
+// ------------------------------------------------------------------------
+struct cache_entry {
+    struct rectx        *ctx;
+    struct cache_entry  *next;      // on the retired list
+    uint32_t            hash;
+    uint32_t            flags;
+    uint32_t            size;       // what it counts against the limit
+    int32_t             refs;       // one for the cache while it's in the table
+    uint32_t            used;       // tick when it was last handed out
+    char                regex[];
+};
+
+struct cache_table {
+    struct cache_table  *next;      // on the retired list
+    uint32_t            mask;       // slots - 1
+    uint32_t            used;       // slots that aren't NULL (including TOMB)
+    struct cache_entry  *slot[];
+};
+
+// An evicted entry leaves this behind so probes carry on past it
+#define CACHE_TOMB              ((struct cache_entry *)1)
+
+#define CACHE_MIN_SLOTS         64
+#define CACHE_SAMPLES           8       // entries we compare to pick an eviction
+#define CACHE_DEFAULT_LIMIT     (1024 * 1024)
+
+static struct {
+    struct cache_table  *table;
+    uint32_t            readers;    // lookups in progress
+    uint32_t            tick;
+    uint32_t            hand;       // where the next eviction looks from
+    uint32_t            limit;      // bytes
+    uint32_t            bytes;
+    uint32_t            entries;
+    uint32_t            hits;
+    uint32_t            misses;
+    uint32_t            evictions;
+    struct cache_entry  *retired;
+    struct cache_table  *retired_tables;
+    char                lock;
+} cache = { .limit = CACHE_DEFAULT_LIMIT };
+
+#define ATOMIC_INC(v)           __atomic_add_fetch(&(v), 1, __ATOMIC_SEQ_CST)
+#define ATOMIC_DEC(v)           __atomic_sub_fetch(&(v), 1, __ATOMIC_SEQ_CST)
+#define ATOMIC_GET(v)           __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define ATOMIC_SET(v, x)        __atomic_store_n(&(v), x, __ATOMIC_SEQ_CST)
+
+static void cache_lock(void) {
+    while (__atomic_test_and_set(&cache.lock, __ATOMIC_ACQUIRE));
+}
+static void cache_unlock(void) {
+    __atomic_clear(&cache.lock, __ATOMIC_RELEASE);
+}
+
+// FNV-1a over the pattern and then the flags
+static uint32_t cache_hash(char *regex, uint32_t flags) {
+    uint32_t h = 2166136261u;
+
+    while (*regex) h = (h ^ (uint8_t)*regex++) * 16777619u;
+    for (int i = 0; i < 4; i++, flags >>= 8) h = (h ^ (flags & 0xff)) * 16777619u;
+    return h;
+}
+
+static struct cache_entry *cache_find(struct cache_table *t, char *regex, uint32_t flags, uint32_t h) {
+    for (uint32_t i = h & t->mask, n = 0; n <= t->mask; i = (i + 1) & t->mask, n++) {
+        struct cache_entry *e = ATOMIC_GET(t->slot[i]);
+        if (!e) return NULL;
+        if (e == CACHE_TOMB) continue;
+        if (e->hash == h && e->flags == flags && strcmp(e->regex, regex) == 0) return e;
+    }
+    return NULL;
+}
+
+// Take a reference, unless it has already gone to 0
+static int cache_ref(struct cache_entry *e) {
+    int32_t refs = __atomic_load_n(&e->refs, __ATOMIC_RELAXED);
+
+    while (refs > 0) {
+        if (__atomic_compare_exchange_n(&e->refs, &refs, refs + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 1;
+    }
+    return 0;
+}
+
+// Free anything retired if there aren't any lookups that could still see it,
+// called with the lock held
+static void cache_collect(void) {
+    if (ATOMIC_GET(cache.readers)) return;
+
+    while (cache.retired) {
+        struct cache_entry *e = cache.retired;
+        cache.retired = e->next;
+        ctx_free(e->ctx);
+        free(e);
+    }
+    while (cache.retired_tables) {
+        struct cache_table *t = cache.retired_tables;
+        cache.retired_tables = t->next;
+        free(t);
+    }
+}
+
+// Drop a reference, the last one retires the entry (it's already out of
+// the table by then since the cache holds one while it's in there)
+static void cache_release(struct cache_entry *e) {
+    if (ATOMIC_DEC(e->refs)) return;
+
+    cache_lock();
+    e->next = cache.retired;
+    cache.retired = e;
+    cache_collect();
+    cache_unlock();
+}
+
+// Take an entry out of the table, called with the lock held
+static void cache_remove(struct cache_table *t, struct cache_entry *e) {
+    for (uint32_t i = e->hash & t->mask; ; i = (i + 1) & t->mask) {
+        if (t->slot[i] != e) continue;
+        ATOMIC_SET(t->slot[i], CACHE_TOMB);
+        break;
+    }
+    cache.bytes -= e->size;
+    cache.entries--;
+    if (ATOMIC_DEC(e->refs) == 0) {
+        e->next = cache.retired;
+        cache.retired = e;
+    }
+}
+
+// Evict the oldest of a few entries until we are under the limit, keep is the
+// one we just added. Called with the lock held.
+static void cache_evict(struct cache_entry *keep) {
+    struct cache_table *t = cache.table;
+
+    while (t && cache.bytes > cache.limit) {
+        struct cache_entry *lru = NULL;
+        int seen = 0;
+        for (uint32_t n = 0; n <= t->mask && seen < CACHE_SAMPLES; n++) {
+            struct cache_entry *e = t->slot[cache.hand++ & t->mask];
+            if (!e || e == CACHE_TOMB || e == keep) continue;
+            if (!lru || (int32_t)(ATOMIC_GET(e->used) - ATOMIC_GET(lru->used)) < 0) lru = e;
+            seen++;
+        }
+        if (!lru) break;
+        cache_remove(t, lru);
+        ATOMIC_INC(cache.evictions);
+    }
+}
+
+// Make sure there's room for one more, a new table is built alongside the
+// old one (without the tombstones) so lookups can carry on using the old one
+static int cache_grow(void) {
+    struct cache_table *old = cache.table;
+    uint32_t slots = CACHE_MIN_SLOTS;
+
+    if (old && (old->used + 1) * 4 <= (old->mask + 1) * 3) return 1;
+    while (slots < (cache.entries + 1) * 2) slots *= 2;
+
+    struct cache_table *t = calloc(1, sizeof(struct cache_table) + slots * sizeof(struct cache_entry *));
+    if (!t) return 0;
+    t->mask = slots - 1;
+    for (uint32_t i = 0; old && i <= old->mask; i++) {
+        struct cache_entry *e = old->slot[i];
+        if (!e || e == CACHE_TOMB) continue;
+        uint32_t k = e->hash & t->mask;
+        while (t->slot[k]) k = (k + 1) & t->mask;
+        t->slot[k] = e;
+        t->used++;
+    }
+    ATOMIC_SET(cache.table, t);
+    if (old) {
+        old->next = cache.retired_tables;
+        cache.retired_tables = old;
+    }
+    return 1;
+}
+
+// Add a newly compiled ctx, if someone else got there first we use theirs.
+// Gives back the entry with a reference for the caller, or NULL if it
+// couldn't be cached and the ctx is still the caller's own.
+static struct cache_entry *cache_add(struct rectx *ctx, char *regex, uint32_t flags, uint32_t h) {
+    int len = strlen(regex);
+    struct cache_entry *e = malloc(sizeof(struct cache_entry) + len + 1);
+    struct cache_entry *rc = NULL;
+
+    cache_lock();
+    struct cache_entry *x = (cache.table ? cache_find(cache.table, regex, flags, h) : NULL);
+    if (x && cache_ref(x)) {
+        rc = x;
+        ATOMIC_SET(x->used, ATOMIC_INC(cache.tick));
+        goto done;
+    }
+    if (!e || !cache_grow()) goto done;         // just don't cache it
+
+    memcpy(e->regex, regex, len + 1);
+    e->ctx = ctx;
+    e->hash = h;
+    e->flags = flags;
+    e->size = ctx->size + jit_code_size(ctx->jit) + sizeof(struct cache_entry) + len + 1;
+    e->refs = 2;                                // the cache and the caller
+    e->used = ATOMIC_INC(cache.tick);
+    rc = e;
+
+    struct cache_table *t = cache.table;
+    uint32_t i = h & t->mask;
+    while (t->slot[i] && t->slot[i] != CACHE_TOMB) i = (i + 1) & t->mask;
+    if (!t->slot[i]) t->used++;
+    ATOMIC_SET(t->slot[i], e);
+    cache.bytes += e->size;
+    cache.entries++;
+    e = NULL;
+
+    cache_evict(rc);
+done:
+    cache_collect();
+    cache_unlock();
+    free(e);
+    if (rc && rc->ctx != ctx) ctx_free(ctx);
+    return rc;
+}
+
+// The cached ctx is never handed out, each caller gets a handle with its own
+// default state that shares everything else with it (like rele_load())
+static struct rectx *cache_handle(struct cache_entry *e, int *error) {
+    struct rectx *c = e->ctx;
+    int dfa = (c->dfa_items ? dfa_layout(NULL, c->node_count, c->dfa_items) * (c->rdfa ? 2 : 1) : 0);
+    int state = ALIGN_PTR(STATE_SIZE(c->node_count, c->slab_tasks, c->task_size, dfa));
+
+    struct rectx *ctx = malloc(sizeof(struct rectx) + state);
+    if (!ctx) {
+        cache_release(e);
+        SET_ERR(RELE_CE_NOMEM);
+        return NULL;
+    }
+    memcpy(ctx, c, sizeof(struct rectx));
+    memset((void *)ctx + sizeof(struct rectx), 0, state);
+    ctx->size = sizeof(struct rectx) + state;
+    ctx->cached = e;
+
+    ctx->state = (struct rematch *)((void *)ctx + sizeof(struct rectx));
+    state_init(ctx->state, ctx, ctx->node_count);
+    SET_ERR(RELE_CE_OK);
+    return ctx;
+}
+
+/**
+ * rele_compile() through the cache. The compiled regex is shared with other
+ * callers but the ctx that comes back has its own default state, so each
+ * thread can rele_match() its own one. rele_free() gives it back.
+ */
+struct rectx *rele_cache_compile(char *regex, uint32_t flags, int *error) {
+    uint32_t h = cache_hash(regex, flags);
+    struct cache_entry *e = NULL;
+
+    ATOMIC_INC(cache.readers);
+    struct cache_table *t = ATOMIC_GET(cache.table);
+    if (t) e = cache_find(t, regex, flags, h);
+    if (e && !cache_ref(e)) e = NULL;
+    ATOMIC_DEC(cache.readers);
+
+    if (e) {
+        ATOMIC_SET(e->used, ATOMIC_INC(cache.tick));
+        ATOMIC_INC(cache.hits);
+        return cache_handle(e, error);
+    }
+    ATOMIC_INC(cache.misses);
+
+    struct rectx *ctx = rele_compile(regex, flags, error);
+    if (!ctx) return NULL;
+    if (!(e = cache_add(ctx, regex, flags, h))) return ctx;    // not cached, it's all ours
+    return cache_handle(e, error);
+}
+
+/**
+ * Set how many bytes of compiled regexes the cache can hold, anything that
+ * is still in use when it's evicted stays around until it's freed.
+ */
+void rele_cache_limit(uint32_t bytes) {
+    cache_lock();
+    cache.limit = bytes;
+    cache_evict(NULL);
+    cache_collect();
+    cache_unlock();
+}
+
+void rele_cache_stats(struct rele_cache_stats *stats) {
+    stats->hits = ATOMIC_GET(cache.hits);
+    stats->misses = ATOMIC_GET(cache.misses);
+    stats->evictions = ATOMIC_GET(cache.evictions);
+
+    cache_lock();
+    stats->entries = cache.entries;
+    stats->bytes = cache.bytes;
+    cache_unlock();
+}
+
+/**
+ * Empty the cache (the counters carry on), again anything in use stays
+ * around until it's freed.
+ */
+void rele_cache_clear(void) {
+    cache_lock();
+    struct cache_table *t = cache.table;
+    for (uint32_t i = 0; t && i <= t->mask; i++) {
+        struct cache_entry *e = t->slot[i];
+        if (e && e != CACHE_TOMB) cache_remove(t, e);
+    }
+    if (t) {
+        ATOMIC_SET(cache.table, NULL);
+        t->next = cache.retired_tables;
+        cache.retired_tables = t;
+    }
+    cache_collect();
+    cache_unlock();
+}
+
+
+// -------------------------------------------------------------------------------
+// Simple matching with escapes and classes
+// -------------------------------------------------------------------------------
+
+// Does leaf n (at string offset k) consume c? This needs to be exactly what the
+// task matcher does, it's used by the DFA and for working out start chars.
+static int consumes(struct rectx *ctx, struct node *n, int k, int c) {
+    int icase = ctx->flags & RELE_CASELESS;
+    char ch = (icase ? fast_tolower(c) : c);
+
+    switch (n->op) {
+        case OP_MATCH:      if (!ch) return 0;
+                            if (n->ch1) return (n->ch1 == ch);
+                            return (matchone(n->cls, ch) != 0);
+        case OP_MATCHSET:   return match_set(ch, NODE_SET(n));
+        case OP_MATCHSTR:   if (icase) return (fast_tolower(NODE_STR(n)[k]) == (unsigned char)ch);
+                            return (NODE_STR(n)[k] == ch);
+        case OP_DOTSTAR:
+        case OP_DOTPLUS:    return (ch != 0);
+        case OP_CRLF:       return (c == 10 || c == 13);
+    }
+    return 0;
+}
+
+// -------------------------------------------------------------------------------
+// TASK EXECUTION
+// -------------------------------------------------------------------------------
+
+// Create a new task, optionally copying any state from the 'from' task. They
+// all come from the slab, NULL if it's used up.
+struct task *task_new(struct rematch *m, struct task *from, struct task *next, struct node *last, struct node *node) {
+    struct rectx *ctx = m->ctx;
+    struct task *task = m->free_list;
+
+    if (!task) return NULL;
+    m->free_list = task->next;
+    STAT_ADD(m, tasks, 1);
+    STAT_LIVE(m, 1);
+
+    if (from) {
+        HEAT_ADD(m, from->n, spawns, 1);
+        // Copy the stack and group matches...
+        //memcpy(task->stack, from->stack, sizeof(task->stack));
+        // I think we have memory alignment issues with the memcpy (which is weird!)
+        // Does seem to be the case on the 32bit qemu build!
+        // Only the used part (from sp up) of the stack matters.
+        uint16_t *stack = TASK_STACK(ctx, task), *fstack = TASK_STACK(ctx, from);
+        for (int i=from->sp; i < ctx->depth; i++) {
+            stack[i] = fstack[i];
+        }
+        int32_t *loops = TASK_LOOPS(ctx, task), *floops = TASK_LOOPS(ctx, from);
+        for (int i=from->lp; i < ctx->loops; i++) {
+            loops[i] = floops[i];
+        }
+
+        memcpy(task->grp, from->grp, sizeof(struct rele_match_t) * ctx->groups);
+        task->sp = from->sp;
+        task->lp = from->lp;
+        task->took = from->took;
+        task->took_gen = from->took_gen;
+    } else {
+        // Make sure matches are -1 to staret with...
+        for (int i=0; i < ctx->groups; i++) {
+            task->grp[i].rm_so = task->grp[i].rm_eo = (int32_t)-1;
+        }
+        task->sp = ctx->depth;
+        task->lp = ctx->loops;
+        task->took = NULL;
+    }
+    task->next = next;
+    task->last = last;
+    task->n = node;
+    task->p = NULL;
+    return task;
+}
+
+static void inline task_release(struct rematch *m, struct task *task) {
+    task->p = NULL;         // so it can't look like a DOTSTAR waiter
+    task->next = m->free_list;
+    m->free_list = task;
+    STAT_ADD(m, recycled, 1);
+    STAT_LIVE(m, -1);
+}
+
+// Forget about any stream (or match that yielded) we were part way through
+static void stream_stop(struct rematch *m) {
+    while (m->run_list) { struct task *t = m->run_list->next; task_release(m, m->run_list); m->run_list = t; }
+    m->stream = 0;
+    m->resume.active = 0;
+}
+
+// Release all of the tasks held by a match state (but not the state itself)
+static void state_clear(struct rematch *m) {
+    // Anything left running from a stream goes first...
+    stream_stop(m);
+
+    // Free the result task if there is one...
+    if (m->done) { task_release(m, m->done); m->done = NULL; }
+
+    free(m->jit_run);
+    m->jit_run = NULL;
+}
+
+// Freeing the context is much simpler now since everything was allocated
+// in a block (including the default state), so we have tasks freeing,
+// successful task freeing and then the main block.
+static void ctx_free(struct rectx *ctx) {
+    state_clear(ctx->state);
+    jit_free(ctx->jit);
+    free(ctx);
+}
+
+// A handle from the cache only owns its state, the rest is given back
+void rele_free(struct rectx *ctx) {
+    struct cache_entry *e = ctx->cached;
+
+    if (!e) { ctx_free(ctx); return; }
+    state_clear(ctx->state);
+    free(ctx);
+    cache_release(e);
+}
+
+// Additional match states allow the same compiled regex to be used from
+// more than one thread at once, each thread needs its own state.
+struct rematch *rele_state_new(struct rectx *ctx) {
+    int dfa = (ctx->dfa_items ? dfa_layout(NULL, ctx->node_count, ctx->dfa_items) * (ctx->rdfa ? 2 : 1) : 0);
+    int size = STATE_SIZE(ctx->node_count, ctx->slab_tasks, ctx->task_size, dfa);
+    struct rematch *m = malloc(size);
+    if (!m) return NULL;
+
+    memset(m, 0, size);
+    state_init(m, ctx, ctx->node_count);
+    return m;
+}
+
+void rele_state_free(struct rematch *m) {
+    state_clear(m);
+    free(m);
+}
+
+/**
+ * Limit how much work a single match can do, so a pattern that's slow on
+ * some text can't hold us up for long. A step is a node visited by the task
+ * matcher (or a thread moved on a char by the native code), if a match needs
+ * more than this it gives up with RELE_ME_LIMIT. Zero means no limit.
+ *
+ * With the RELE_YIELD match flag it's the steps a match takes before it
+ * stops and returns RELE_ME_INPROGRESS, see rele_exec_resume().
+ */
+void rele_state_limit(struct rematch *m, uint32_t steps) {
+    m->limit = steps;
+}
+
+void rele_match_limit(struct rectx *ctx, uint32_t steps) {
+    rele_state_limit(ctx->state, steps);
+}
+
+// Each match (or stream) starts counting again, a resumed one carries on
+static inline void stats_reset(struct rematch *m) {
+#ifdef RELE_STATS
+    memset(&m->stats, 0, sizeof(m->stats));
+    m->stats.peak = m->live;
+#endif
+}
+
+/**
+ * Fill in stats with what the last match on this state did and the memory
+ * the compiled regex uses. The match counters are only kept if we were
+ * built with RELE_STATS, returns 1 if they were (0 and they are all zero).
+ */
+int rele_state_stats(struct rematch *m, struct rele_stats *stats) {
+    struct rectx *ctx = m->ctx;
+    struct set *lo = NULL, *hi = NULL;
+    int kept = 0;
+
+#ifdef RELE_STATS
+    *stats = m->stats;
+    kept = 1;
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+
+    stats->held = jit_held(m);
+
+    // Sets are handed out in order and copies of a node share them, so the
+    // first and last used tell us how many there are
+    for (struct node *n = ctx->node_base; n < ctx->node_base + ctx->node_count; n++) {
+        if (n->op == OP_MATCHSET) {
+            if (!lo || NODE_SET(n) < lo) lo = NODE_SET(n);
+            if (!hi || NODE_SET(n) > hi) hi = NODE_SET(n);
+        } else if (n->op == OP_MATCHSTR) {
+            stats->string_bytes += SEARCH_SIZE(n->len);
+        }
+    }
+    if (lo) stats->set_bytes = (hi - lo + 1) * sizeof(struct set);
+
+    int dfa = (ctx->dfa_items ? dfa_layout(NULL, ctx->node_count, ctx->dfa_items) * (ctx->rdfa ? 2 : 1) : 0);
+    stats->nodes = ctx->node_count;
+    stats->node_bytes = ctx->node_count * sizeof(struct node);
+    stats->state_bytes = STATE_SIZE(ctx->node_count, ctx->slab_tasks, ctx->task_size, dfa);
+    stats->size = ctx->size;
+    return kept;
+}
+
+int rele_get_stats(struct rectx *ctx, struct rele_stats *stats) {
+    return rele_state_stats(ctx->state, stats);
+}
+
+// Compare the group structures between two tasks to see if they are the same
+// We can do this with memcmp which should be optimised by the compiler given
+// they are word-wide comparisons.
+static inline int has_same_groups(struct rematch *m, struct task *a, struct task *b) {
+    if (memcmp(a->grp, b->grp, m->ctx->groups * sizeof(struct rele_match_t)) == 0) return 1;
+    return 0;
+}
+
+// Compare the stack (including sp) on two tasks to see if they are the same
+static inline int has_same_stack(struct rectx *ctx, struct task *a, struct task *b) {
+    if (a->sp != b->sp) return 0;
+    uint16_t *as = TASK_STACK(ctx, a), *bs = TASK_STACK(ctx, b);
+    for (int i=a->sp; i < ctx->depth; i++) {
+        if (as[i] != bs[i]) return 0;
+    }
+    return 1;
+}
+
+// With counters or backreferences two tasks at the same node only behave the
+// same from here on if these match as well
+static inline int has_same_state(struct rematch *m, struct task *a, struct task *b) {
+    if (HAS_FLAG(m->ctx->has, HAS_BACKREF) && !has_same_groups(m, a, b)) return 0;
+    return has_same_stack(m->ctx, a, b);
+}
+
+/**
+ * Task Deduplication ... if we are have matched something, then see if
+ * another task has already matched the same node at this position. Tasks
+ * are in priority order, so the first one to get here wins and anything
+ * after it will behave identically from here on, so it can die.
+ *
+ * That's not true if we have counters or backreferences, as the stack and
+ * group matches also affect what happens next, in which case we fall back
+ * to looking at all the tasks that went before us to see if the state is
+ * all the same. Each task records the node it consumed at (and when) for
+ * this, where it goes next depends on the op so t->last can't tell us.
+ */
+static inline int has_prior_match(struct rematch *m, struct task *run_list, struct node *n, struct task *t) {
+    struct rectx *ctx = m->ctx;
+    int id = n - ctx->node_base;
+
+    if (m->seen[id] != m->gen) { m->seen[id] = m->gen; goto consume; }
+    if (!ctx->has) goto dupe;
+
+    for (struct task *x = run_list; x != t; x = x->next) {
+        if (x->took == n && x->took_gen == m->gen && has_same_state(m, x, t)) goto dupe;
+    }
+
+consume:
+    t->took = n;
+    t->took_gen = m->gen;
+    // Everything that calls us is about to consume, a string or group takes
+    // all of its length now.
+    HEAT_ADD(m, n, bytes, n->op == OP_MATCHSTR ? n->len : n->op == OP_MATCHGRP ?
+                    t->grp[n->mgrp].rm_eo - t->grp[n->mgrp].rm_so : 1);
+    return 0;
+
+dupe:
+    STAT_ADD(m, dedupes, 1);
+    HEAT_ADD(m, n, dedupes, 1);
+    return 1;
+}
+
+/**
+ * Deduplication of tasks that are waiting for a DOTSTAR/DOTPLUS forward match,
+ * they will all be waiting for the same place so we only need one of them, the
+ * one with the highest priority. If an existing waiter has already been seen
+ * in this pass it's ahead of us so we die, otherwise we take over and it gets
+ * marked to die when it wakes up. With counters or backreferences it also has
+ * to be in the same state as us.
+ */
+static inline int has_prior_waiter(struct rematch *m, struct node *n, struct task *t) {
+    struct rectx *ctx = m->ctx;
+    struct task **w = &m->waiter[n - ctx->node_base];
+
+    t->gen = m->gen;
+    if (*w && *w != t && (*w)->n == n && (*w)->p == t->p && (!ctx->has || has_same_state(m, *w, t))) {
+        if ((*w)->gen == m->gen) return 1;
+        (*w)->n = NULL;
+    }
+    *w = t;
+    return 0;
+}
+
+/**
+ * In a few places we need to find where the next match occurs, this is a helper function
+ * that can do that based on whatever type of node we need to check. Note this only supports
+ * a certain set of things.
+ * 
+ * We try to be as efficient as possible as this might be called in a loop.
+ */
+char *next_match(struct node *n, char *start, char *p, char *end, int icase, struct task *t) {
+    switch (n->op) {
+        case OP_MATCH:
+            if (n->ch1) return scan_byte(p, end, n->ch1, icase);
+            return scan_class(n->ch2, p, end);
+
+        case OP_MATCHSTR:
+            return search_find(n, p, end, icase);
+
+        case OP_MATCHSET:
+            return scan_set(&NODE_SET(n)->scan, p, end, 0);
+
+        case OP_ANCHOR:
+            switch (n->ch1) {
+                case 'A':   if (p == start) { return p; } else { return NULL; }
+                case 'Z':   return end;
+                case '^':   if (p == start || p[-1] == '\n') return p;
+                            p = memchr(p, '\n', (size_t)(end - p));
+                            if (!p || p == end) return NULL;
+                            return (char *)(p + 1);
+                case '$':   if (p == end) return end;
+                            p = memchr(p, '\n', (size_t)(end - p));
+                            if (!p) return end;
+                            return p;
+                default:    return p;
+            }
+            // We only cater for specific types here...
+            // TODO
+            return NULL;
+
+        case OP_MATCHGRP:
+            if (!t) return NULL;
+            if (t->grp[n->mgrp].rm_so < 0) return p;
+            return search_plain(start + t->grp[n->mgrp].rm_so,
+                                t->grp[n->mgrp].rm_eo - t->grp[n->mgrp].rm_so, p, end, icase);
+    }
+    return NULL;
+}
+
+
+/**
+ * Find the required char at or after p, returns 0 if there isn't one.
+ */
+static inline int find_req(struct rematch *m, char *p, char *end) {
+    if (p > end) return 0;
+    m->req_hit = memchr(p, m->ctx->req, end - p);
+    return m->req_hit != NULL;
+}
+
+/**
+ * Skip to the next char a match could start with.
+ */
+static inline char *first_char(struct rectx *ctx, char *p, char *end) {
+    if (ctx->first_count == 1) return memchr(p, ctx->first_ch, end - p);
+    return scan_set(&ctx->first, p, end, 0);
+}
+
+/**
+ * Work out the next place a match could start, at or after p. If we have a
+ * fast start it needs to match there, otherwise it has to be one of the first
+ * chars, and if we have a required char then there needs to be one in reach.
+ */
+static inline char *find_start(struct rematch *m, struct node *fs, char *start, char *p, char *end, int icase) {
+    struct rectx *ctx = m->ctx;
+
+    while (1) {
+        if (fs) {
+            p = next_match(fs, start, p, end, icase, NULL);
+            if (!p) return NULL;
+        } else if (ctx->first_count) {
+            p = first_char(ctx, p, end);
+            if (!p) return NULL;
+        }
+        if (!ctx->req) return p;
+        if (m->req_hit < p + ctx->req_min && !find_req(m, p + ctx->req_min, end)) return NULL;
+        if (ctx->req_max == NO_MAX || m->req_hit - p <= ctx->req_max) return p;
+        p = m->req_hit - ctx->req_max;
+    }
+}
+
+static inline char *next_start(struct rematch *m, struct node *fs, char *start, char *p, char *end, int icase) {
+    char *q = find_start(m, fs, start, p, end, icase);
+    STAT_ADD(m, skipped, (q ? q : end) - p);
+    return q;
+}
+
+/**
+ * The same for a stream, at or after p but we can only use the first chars. If
+ * there isn't one in this chunk then it could be the first of the next.
+ */
+static inline char *stream_start(struct rematch *m, char *p, char *end) {
+    if (p >= end || !m->ctx->first_count) return p;
+    p = first_char(m->ctx, p, end);
+    return (p ? p : end);
+}
+
+// -------------------------------------------------------------------------------
+// LAZY DFA
+// -------------------------------------------------------------------------------
+//
+// Without counters or backreferences the only thing that makes one task
+// different from another (ignoring the groups) is where it is in the tree, so
+// the whole run list can be turned into a DFA state. Each state is the set of
+// places in the tree waiting for the next char, built the first time we need
+// it and then kept in a cache in the match state.
+//
+// We only use it to find out if there is a match at all, so the order of the
+// tasks, laziness and the DONE cut off don't matter.
+//
+// Places are held as 32bit items: the direction we came from (like t->last),
+// the node, and how far through a string we are.
+
+#define DIR_PARENT          0       // arrived from above
+#define DIR_A               1       // back up from leg a
+#define DIR_B               2       // back up from leg b
+#define DIR_SELF            3       // part way through a leaf
+
+#define ITEM(id, dir, off)  (((uint32_t)(off) << 18) | ((uint32_t)(id) << 2) | (dir))
+#define ITEM_ID(i)          (((i) >> 2) & 0xffff)
+#define ITEM_DIR(i)         ((i) & 3)
+#define ITEM_OFF(i)         ((i) >> 18)
+
+// What the previous char was, only matters for some anchors...
+#define DCTX_OTHER          0
+#define DCTX_WORD           1
+#define DCTX_NL             2
+#define DCTX_START          3
+
+#define DFA_FAIL            0       // run out of cache, use the tasks
+#define DFA_EMPTY           0x8000  // flag on a transition to nothing running
+#define DFA_START           0x8000  // (reverse) flag for a match starting after c
+#define DFA_MATCH           0xffff  // a transition that found a match
+#define DFA_MAX_FLUSH       8       // cache flushes before we give up on a run
+
+// Modes for a forward run
+#define DFA_ANCHORED        (1 << 0)    // only start at the start of the text
+#define DFA_FULL            (1 << 1)    // only match at the end of the text
+
+// A cached state, the transitions (one per byte class) and the items follow.
+// States are referred to by their offset in the cache (in words) so that
+// zero can mean a transition we haven't worked out yet.
+struct dstate {
+    uint32_t        hash;
+    uint16_t        nitems;
+    uint8_t         context;        // DCTX_xxx for the char that got us here
+    uint8_t         atend;          // 0 = don't know, 1 = no match, 2 = match at the end
+    uint16_t        next[];
+};
+
+#define DSTATE(d, id)           ((struct dstate *)((d)->cache + ((id) * 4)))
+#define DSTATE_ITEMS(ctx, s)    ((uint32_t *)((void *)(s) + (((sizeof(struct dstate) + ((ctx)->nclasses * 2)) + 3) & ~3)))
+#define DSTATE_SIZE(ctx, n)     ((((sizeof(struct dstate) + ((ctx)->nclasses * 2)) + 3) & ~3) + ((n) * 4))
+
+struct dfa {
+    uint32_t        *items;         // items for the state we are building
+    uint32_t        *stack;         // closure work stack
+    uint32_t        *visit;         // gen stamp per node/direction, visited then emitted
+    uint32_t        vgen;
+
+    uint16_t        *hash;          // open addressed lookup of states
+    int             hsize;          // a power of two
+    int             hused;
+
+    uint8_t         *cache;         // where the states live
+    int             size;
+    int             used;
+    int             flushes;        // in this run
+    int             jump;           // flag transitions to empty states
+    int             rev;            // runs backwards from the end of the text
+    int             mode;           // DFA_ANCHORED etc, the states depend on it
+
+    uint16_t        empty[4];       // the state with nothing running, per context
+    uint16_t        first[4];       // the state with just one node running, per context
+};
+
+// Work out the layout of a DFA (the struct followed by its arrays and the cache)
+// and set the pointers if we have one, returns the size needed. The cache grows
+// with the pattern, up to a limit.
+static int dfa_layout(struct dfa *d, int nodes, int items) {
+    int cache = 1024 + (nodes * 128);
+    if (cache > DFA_MAX_CACHE) cache = DFA_MAX_CACHE;
+    int hsize = 64;
+    while (hsize < cache / 16) hsize <<= 1;
+
+    int size = ALIGN_PTR(sizeof(struct dfa));
+    int o_items = size;     size += items * sizeof(uint32_t);
+    int o_stack = size;     size += ((4 * nodes) + items + 1) * sizeof(uint32_t);
+    int o_visit = size;     size += (8 * nodes) * sizeof(uint32_t);
+    int o_hash = size;      size += hsize * sizeof(uint16_t);
+    int o_cache = ALIGN_PTR(size);
+    size = o_cache + cache;
+
+    if (d) {
+        d->items = (uint32_t *)((void *)d + o_items);
+        d->stack = (uint32_t *)((void *)d + o_stack);
+        d->visit = (uint32_t *)((void *)d + o_visit);
+        d->hash = (uint16_t *)((void *)d + o_hash);
+        d->hsize = hsize;
+        d->cache = (uint8_t *)d + o_cache;
+        d->size = cache;
+        d->used = 4;            // so no state is at zero
+    }
+    return ALIGN_PTR(size);
+}
+
+// The context a char leaves behind for the next one
+static inline int dfa_context(struct rectx *ctx, int c) {
+    if (!ctx->dfa_context) return DCTX_OTHER;
+    if (c == '\n') return DCTX_NL;
+    if (is_word(c)) return DCTX_WORD;
+    return DCTX_OTHER;
+}
+
+// Check an anchor given the previous context and next char (-1 at the end)
+static int dfa_anchor(char a, int pc, int c) {
+    int pw = (pc == DCTX_WORD);
+    int nw = (c >= 0 && is_word(c));
+
+    switch (a) {
+        case 'A':   return (pc == DCTX_START);
+        case 'Z':   return (c < 0);
+        case '^':   return (pc == DCTX_START || pc == DCTX_NL);
+        case '$':   return (c < 0 || c == '\n');
+        case 'b':   return (pw ^ nw);
+        case 'B':   return !(pw ^ nw);
+    }
+    return 0;
+}
+
+// Running backwards the anchors at either end swap over, the context is
+// then the char after us and c the one before.
+static inline char dfa_mirror(char a) {
+    switch (a) {
+        case 'A':   return 'Z';
+        case 'Z':   return 'A';
+        case '^':   return '$';
+        case '$':   return '^';
+    }
+    return a;
+}
+
+// Split the byte classes so that bytes that do and don't match v are apart
+static void dfa_split(uint8_t *cls, uint16_t *count, uint8_t *v) {
+    int16_t map[512];
+
+    memset(map, 0xff, sizeof(map));
+    int n = 0;
+    for (int c=0; c < 256; c++) {
+        int key = (cls[c] * 2) + v[c];
+        if (map[key] < 0) map[key] = n++;
+        cls[c] = map[key];
+    }
+    *count = n;
+}
+
+// Group the bytes into classes that every leaf (and anchor) treats the same
+// so the states only need a transition per class rather than per byte.
+static void dfa_classes(struct rectx *ctx) {
+    uint8_t v[256];
+
+    memset(ctx->bclass, 0, 256);
+    ctx->nclasses = 1;
+
+    for (struct node *n = ctx->node_base; n < ctx->node_base + ctx->node_count; n++) {
+        switch (n->op) {
+            case OP_MATCHSTR:
+                for (int k=0; k < n->len; k++) {
+                    for (int c=0; c < 256; c++) v[c] = consumes(ctx, n, k, c);
+                    dfa_split(ctx->bclass, &ctx->nclasses, v);
+                }
+                break;
+            case OP_MATCH:
+            case OP_MATCHSET:
+            case OP_DOTSTAR:
+            case OP_DOTPLUS:
+                for (int c=0; c < 256; c++) v[c] = consumes(ctx, n, 0, c);
+                dfa_split(ctx->bclass, &ctx->nclasses, v);
+                break;
+            case OP_CRLF:
+                for (int c=0; c < 256; c++) v[c] = (c == 10);
+                dfa_split(ctx->bclass, &ctx->nclasses, v);
+                for (int c=0; c < 256; c++) v[c] = (c == 13);
+                dfa_split(ctx->bclass, &ctx->nclasses, v);
+                break;
+            case OP_ANCHOR:
+                if (n->ch1 == '^' || n->ch1 == 'b' || n->ch1 == 'B') ctx->dfa_context = 1;
+                if (n->ch1 == '$' && ctx->tail) ctx->dfa_context = 1;     // backwards it's ^
+                if (n->ch1 == '$') {
+                    for (int c=0; c < 256; c++) v[c] = (c == '\n');
+                    dfa_split(ctx->bclass, &ctx->nclasses, v);
+                }
+                break;
+        }
+    }
+    // If we need the context then the bytes need to agree on it...
+    if (ctx->dfa_context) {
+        for (int c=0; c < 256; c++) v[c] = (c == '\n');
+        dfa_split(ctx->bclass, &ctx->nclasses, v);
+        for (int c=0; c < 256; c++) v[c] = is_word(c);
+        dfa_split(ctx->bclass, &ctx->nclasses, v);
+    }
+}
+
+// Which way we come back up from a child
+static inline int dfa_dir(struct node *n) {
+    struct node *p = PARENT(n);
+    if ((p->op == OP_CONCAT || p->op == OP_ALTERNATE) && LEG_A(p) == n) return DIR_A;
+    return DIR_B;
+}
+
+/**
+ * Follow everything from the items in a state (and a new start) through the
+ * tree until they hit something that needs a char, the ones that consume c
+ * make up the items of the next state. Returns 1 if we reach DONE, c is -1
+ * at the end of the text.
+ *
+ * A reverse DFA walks the tree the other way round (b before a, strings
+ * from the end, and the anchors swapped) so it reads the text backwards.
+ * There are no new starts, it begins with the whole pattern at the end of
+ * the text, and returns 1 when it gets back out of the top, meaning a match
+ * could start here. It keeps going so we can find the leftmost.
+ */
+static int dfa_closure(struct rematch *m, struct dfa *d, struct dstate *s, int c, int *count) {
+    struct rectx *ctx = m->ctx;
+    uint32_t *stack = d->stack;
+    uint32_t *visit = d->visit;
+    uint32_t *emit = d->visit + (4 * ctx->node_count);
+    uint32_t *kernel = DSTATE_ITEMS(ctx, s);
+    int rev = d->rev;
+    int sp = 0, n = 0, start = 0;
+
+    if (!++d->vgen) { memset(d->visit, 0, 8 * ctx->node_count * sizeof(uint32_t)); d->vgen = 1; }
+    uint32_t gen = d->vgen;
+
+// Add a place to look at (once), or an item for the next state (once)
+#define DPUSH(x, dir)   do { uint32_t k = ((x) - ctx->node_base) * 4 + (dir); \
+                            if (visit[k] != gen) { visit[k] = gen; stack[sp++] = k; } } while(0)
+#define DUP(x)          DPUSH(PARENT(x), dfa_dir(x))
+#define DEMIT(x, dir)   do { uint32_t k = ((x) - ctx->node_base) * 4 + (dir); \
+                            if (emit[k] != gen) { emit[k] = gen; d->items[n++] = k; } } while(0)
+
+    if (!rev && !(d->mode & DFA_ANCHORED)) DPUSH(ctx->root, DIR_PARENT);
+    for (int i=0; i < s->nitems; i++) {
+        uint32_t item = kernel[i];
+        if (ITEM_DIR(item) == DIR_SELF) { stack[sp++] = item; continue; }
+        DPUSH(ctx->node_base + ITEM_ID(item), ITEM_DIR(item));
+    }
 
-            // With the new approach to strings, this can only be a few things
-            // anchors, CRLF, \d, \w etc, dot, and group references
-            case '.':
-                last = create_node_here(ctx, last, OP_MATCH, NULL, NULL);
-                last->ch2 = (flags & RELE_NEWLINE) ? ',' : '.';
-                break;
+    while (sp) {
+        uint32_t item = stack[--sp];
+        struct node *x = ctx->node_base + ITEM_ID(item);
+        int dir = ITEM_DIR(item);
 
-            case '\\':
-                p++;
-                last = create_node_here(ctx, last, OP_MATCH, NULL, NULL);
-                if (is_group(p, &(last->mgrp), &p, NULL)) {
-                        if (!p || (last->mgrp >= ctx->groups)) { SET_ERR(RELE_CE_BADGRP); goto fail; }
-                        last->op = OP_MATCHGRP;
-                        continue;                   // p will be correct
+        switch (x->op) {
+            case OP_CONCAT:
+                if (rev) {
+                    if (x == ctx->root) start = 1;      // only from the top group
+                    else if (dir == DIR_PARENT) DPUSH(LEG_B(x), DIR_PARENT);
+                    else if (dir == DIR_B) DPUSH(LEG_A(x), DIR_PARENT);
+                    else DUP(x);
+                    break;
                 }
-                switch (*p) {
-                    case 0:     SET_ERR(RELE_CE_SYNTAX); goto fail;
-                    case 'R':   last->op = OP_CRLF; break;
-                    case 'A':
-                    case 'Z':
-                    case 'b':
-                    case 'B':   last->op = OP_ANCHOR; last->ch1 = *p; break;
-                    default:    last->ch2 = *p; break;  // \w \d etc.
+                if (dir == DIR_PARENT) DPUSH(LEG_A(x), DIR_PARENT);
+                else if (dir == DIR_A) DPUSH(LEG_B(x), DIR_PARENT);
+                else DUP(x);
+                break;
+            case OP_ALTERNATE:
+                if (dir == DIR_PARENT) { DPUSH(LEG_A(x), DIR_PARENT); DPUSH(LEG_B(x), DIR_PARENT); }
+                else DUP(x);
+                break;
+            case OP_QUESTION:
+                if (dir == DIR_PARENT) DPUSH(LEG_B(x), DIR_PARENT);
+                DUP(x);
+                break;
+            case OP_STAR:
+                DPUSH(LEG_B(x), DIR_PARENT);
+                DUP(x);
+                break;
+            case OP_PLUS:
+                DPUSH(LEG_B(x), DIR_PARENT);
+                if (dir == DIR_B) DUP(x);
+                break;
+            case OP_GROUP:
+                if (dir == DIR_PARENT && x->b && !EMPTY_GROUP(x)) DPUSH(LEG_B(x), DIR_PARENT);
+                else DUP(x);
+                break;
+            case OP_ANCHOR:
+                if (dfa_anchor(rev ? dfa_mirror(x->ch1) : x->ch1, s->context, c)) DUP(x);
+                break;
+            case OP_MATCH:
+            case OP_MATCHSET:
+                if (c >= 0 && consumes(ctx, x, 0, c)) DEMIT(PARENT(x), dfa_dir(x));
+                break;
+            case OP_MATCHSTR: {
+                int k = (dir == DIR_SELF ? ITEM_OFF(item) : 0);
+                if (c < 0 || !consumes(ctx, x, (rev ? x->len - 1 - k : k), c)) break;
+                if (k + 1 == x->len) { DEMIT(PARENT(x), dfa_dir(x)); break; }
+                d->items[n++] = ITEM(x - ctx->node_base, DIR_SELF, k + 1);
+                break;
+            }
+            case OP_CRLF:
+                if (rev) {
+                    // Backwards it's \n with an optional \r before it
+                    if (dir == DIR_PARENT) { if (c == 10) DEMIT(x, DIR_SELF); break; }
+                    DUP(x);
+                    if (c == 13) DEMIT(PARENT(x), dfa_dir(x));
+                    break;
                 }
+                if (c == 10) DEMIT(PARENT(x), dfa_dir(x));
+                else if (c == 13 && dir == DIR_PARENT) DEMIT(x, DIR_SELF);
                 break;
-            
-            default:
-                SET_ERR(RELE_CE_SYNTAX);
-                goto fail;   
+            case OP_DOTSTAR:
+                DUP(x);
+                if (c >= 0 && consumes(ctx, x, 0, c)) DEMIT(x, DIR_SELF);
+                break;
+            case OP_DOTPLUS:
+                if (dir == DIR_SELF) DUP(x);
+                if (c >= 0 && consumes(ctx, x, 0, c)) DEMIT(x, DIR_SELF);
+                break;
+            case OP_DONE:
+                if (rev) { start = 1; break; }
+                if ((d->mode & DFA_FULL) && c >= 0) break;
+                return 1;
         }
-        p++;
     }
-    // Quick error check on groups...
-    if (open_groups != 0) { SET_ERR(RELE_CE_BADGRP); goto fail; }
+#undef DPUSH
+#undef DUP
+#undef DEMIT
 
-    // Postprocessing just needs to ensure there's a DONE in the right place
-    // We put it after the group b node to save one more parent move.
-    //last = create_node_here(ctx, ctx->root->b, OP_DONE, NULL, NULL);
-    last = create_node_here(ctx, ctx->root, OP_DONE, NULL, NULL);
+    *count = n;
+    return start;
+}
 
-    // Run the optimisation check...
-    ctx->fast_start = optimiser(ctx);
-    if (flags & RELE_NO_FASTSTART) ctx->fast_start = NULL;
+// Throw away all of the states
+static void dfa_flush(struct dfa *d) {
+    memset(d->hash, 0, d->hsize * sizeof(uint16_t));
+    memset(d->empty, 0, sizeof(d->empty));
+    memset(d->first, 0, sizeof(d->first));
+    d->hused = 0;
+    d->used = 4;
+    d->flushes++;
+}
 
-    // And we're done...
-    return ctx;
+/**
+ * Find (or create) the state with the items we have just built, if the cache
+ * is full we flush it and start again, unless that's happening too often.
+ */
+static uint16_t dfa_state(struct rematch *m, struct dfa *d, int count, int context) {
+    struct rectx *ctx = m->ctx;
+    uint32_t *items = d->items;
+
+    // Sort the items so the same set always looks the same...
+    for (int i=1; i < count; i++) {
+        uint32_t v = items[i];
+        int j = i;
+        while (j && items[j-1] > v) { items[j] = items[j-1]; j--; }
+        items[j] = v;
+    }
+    uint32_t hash = 2166136261u ^ context;
+    for (int i=0; i < count; i++) hash = (hash ^ items[i]) * 16777619u;
+
+    int mask = d->hsize - 1;
+    int h = hash & mask;
+    while (d->hash[h]) {
+        struct dstate *s = DSTATE(d, d->hash[h]);
+        if (s->hash == hash && s->nitems == count && s->context == context &&
+                    memcmp(DSTATE_ITEMS(ctx, s), items, count * sizeof(uint32_t)) == 0) return d->hash[h];
+        h = (h + 1) & mask;
+    }
 
-fail:
-    free(ctx);
-    return NULL;
+    // Need a new one, make sure we have space (and keep the hash sparse)...
+    // A state too big for even an empty cache is left to the tasks.
+    int size = DSTATE_SIZE(ctx, count);
+    if (d->used + size > d->size || (d->hused + 1) * 4 > d->hsize * 3) {
+        if (d->flushes >= DFA_MAX_FLUSH || 4 + size > d->size) return DFA_FAIL;
+        dfa_flush(d);
+        h = hash & mask;
+    }
+    uint16_t id = d->used / 4;
+    struct dstate *s = DSTATE(d, id);
+    d->used += size;
+
+    s->hash = hash;
+    s->nitems = count;
+    s->context = context;
+    s->atend = 0;
+    memset(s->next, 0, ctx->nclasses * sizeof(uint16_t));
+    memcpy(DSTATE_ITEMS(ctx, s), items, count * sizeof(uint32_t));
+
+    d->hash[h] = id;
+    d->hused++;
+    return id;
 }
 
+// The state with nothing running (other than a new start) for a context
+static uint16_t dfa_empty(struct rematch *m, struct dfa *d, int context) {
+    if (!d->empty[context]) d->empty[context] = dfa_state(m, d, 0, context);
+    return d->empty[context];
+}
 
-// -------------------------------------------------------------------------------
-// Simple matching with escapes and classes
-// -------------------------------------------------------------------------------
-static int matchone(char s, char ch) {
-    if (s == '.') return 1;
-    if (s == ',') return (ch != '\n');      // multi-line version of dot
-    
-    switch(s) {
-        // Types...
-        case 'd':       return isdigit(ch);
-        case 'D':       return !isdigit(ch);
-        case 'w':       return (isalnum(ch) || ch == '_');
-        case 'W':       return !(isalnum(ch) || ch == '_');
-        case 's':       return isspace(ch);
-        case 'S':       return !isspace(ch);
-
-        // TODO: needs to fail in compile rather than here
-        default:
-                        //fprintf(stderr, "unknown matchone s=[%c] ch=[%c]\n", s, ch);
-                        return -1;
+// The state with just n running, for when we don't add new starts
+static uint16_t dfa_first(struct rematch *m, struct dfa *d, struct node *n, int context) {
+    if (!d->first[context]) {
+        d->items[0] = ITEM(n - m->ctx->node_base, DIR_PARENT, 0);
+        d->first[context] = dfa_state(m, d, 1, context);
     }
+    return d->first[context];
 }
 
-// -------------------------------------------------------------------------------
-// TASK EXECUTION
-// -------------------------------------------------------------------------------
+// Work out (and remember) where c takes us from a state
+static uint16_t dfa_step(struct rematch *m, struct dfa *d, uint16_t id, int c) {
+    struct rectx *ctx = m->ctx;
+    struct dstate *s = DSTATE(d, id);
+    int count;
+
+    int done = dfa_closure(m, d, s, c, &count);
+    if (done && !d->rev) {
+        s->next[ctx->bclass[c]] = DFA_MATCH;
+        return DFA_MATCH;
+    }
+    int flushes = d->flushes;
+    uint16_t next = dfa_state(m, d, count, dfa_context(ctx, c));
+    if (next && d->jump && !count) next |= DFA_EMPTY;
+    if (next && done) next |= DFA_START;
+
+    // If we flushed then we don't exist anymore...
+    if (next && d->flushes == flushes) s->next[ctx->bclass[c]] = next;
+    return next;
+}
 
-// Create a new task, optionally copying any state from the 'from' task
-struct task *task_new(struct rectx *ctx, struct task *from, struct task *next, struct node *last, struct node *node) {
-    struct task *task = ctx->free_list;
+/**
+ * Run the DFA over the text from p, returns 1 if there's a match, 0 if not or
+ * -1 if we couldn't tell (because the cache kept filling up).
+ *
+ * Whenever nothing is running we can skip ahead to the next start, so
+ * transitions to those states are flagged to get us out of the inner loop.
+ * No match can start before the last of those, so we hand it back in from.
+ * If we are anchored there's only one start, so once nothing is running
+ * we are done.
+ */
+static int dfa_exec(struct rematch *m, char *start, char *p, char *end, char **from, int mode) {
+    struct rectx *ctx = m->ctx;
+    struct dfa *d = m->dfa;
+    uint8_t *bclass = ctx->bclass;
+    struct node *fs = ctx->fast_start;
+    int icase = ctx->flags & RELE_CASELESS;
+    int context = (p == start) ? DCTX_START : dfa_context(ctx, (unsigned char)p[-1]);
 
-    if (task) {
-        ctx->free_list = task->next;
-    } else {
-        // Allocate a task with enough space for gorup matching...
-        task = (struct task *)malloc(sizeof(struct task) + (ctx->groups * sizeof(struct rele_match_t)));
-        if (!task) return NULL;
-        memset((void *)task, 0, sizeof(struct task));
+    if (fs && (fs->op == OP_DOTSTAR || fs->op == OP_DOTPLUS)) fs = NULL;
 
-        tcount++;
-//        fprintf(stderr, "max task count is %d\n", tcount);
+    // The states are different if we are anchored or need a full match
+    if (d->mode != mode) {
+        dfa_flush(d);
+        d->mode = mode;
     }
+    int anchored = (mode & DFA_ANCHORED);
+
+    d->jump = (anchored || fs || ctx->first_count || (ctx->req && ctx->req_max != NO_MAX));
+    d->flushes = 0;
+    uint16_t id = (anchored ? dfa_first(m, d, ctx->root, context) : dfa_empty(m, d, context));
+    if (!id) return -1;
+
+    *from = p;
+    while (p < end) {
+        if (d->jump && !DSTATE(d, id)->nitems) {
+            if (anchored) return 0;
+            char *cand = next_start(m, fs, start, p, end, icase);
+            if (!cand) return 0;
+            if (cand != p) {
+                p = cand;
+                id = dfa_empty(m, d, dfa_context(ctx, (unsigned char)p[-1]));
+                if (!id) return -1;
+            }
+            *from = p;
+            if (p >= end) break;
+        }
 
-    if (from) {
-        // Copy the stack and group matches...
-        //memcpy(task->stack, from->stack, sizeof(task->stack));
-        // I think we have memory alignment issues with the memcpy (which is weird!)
-        // Does seem to be the case on the 32bit qemu build!
-        for (int i=0; i < TASK_STACK_SIZE; i++) {
-            task->stack[i] = from->stack[i];
+        // Follow the transitions we already have for as long as we can...
+        uint16_t next;
+        while (1) {
+            next = DSTATE(d, id)->next[bclass[(unsigned char)*p]];
+            if ((uint16_t)(next - 1) >= DFA_EMPTY - 1) break;
+            id = next;
+            if (++p == end) goto end;
+        }
+        if (!next) {
+            next = dfa_step(m, d, id, (unsigned char)*p);
+            if (next == DFA_FAIL) return -1;
+        }
+        if (next == DFA_MATCH) return 1;
+        id = next & ~DFA_EMPTY;
+        p++;
+    }
+
+end: ;
+    // Now see if we match at the end...
+    struct dstate *s = DSTATE(d, id);
+    if (!s->atend) {
+        int count;
+        s->atend = 1 + dfa_closure(m, d, s, -1, &count);
+    }
+    return s->atend - 1;
+}
+
+/**
+ * Run the reverse DFA back from the end of the text, for patterns that can
+ * only match at the end. Returns 1 if there's a match and puts the leftmost
+ * start in from, 0 if not, or -1 if we couldn't tell.
+ *
+ * Most text fails within a few chars of the end, so this is a lot quicker
+ * than reading everything forwards.
+ */
+static int dfa_rexec(struct rematch *m, char *start, char *end, char **from) {
+    struct rectx *ctx = m->ctx;
+    struct dfa *d = m->rdfa;
+    uint8_t *bclass = ctx->bclass;
+    char *p = end;
+
+    *from = NULL;
+    d->rev = 1;
+    d->flushes = 0;
+    uint16_t id = dfa_first(m, d, (ctx->root->op == OP_CONCAT) ? LEG_A(ctx->root) : ctx->root, DCTX_START);
+    if (!id) return -1;
+
+    while (p > start && DSTATE(d, id)->nitems) {
+        uint16_t next = DSTATE(d, id)->next[bclass[(unsigned char)p[-1]]];
+        if (!next) {
+            next = dfa_step(m, d, id, (unsigned char)p[-1]);
+            if (next == DFA_FAIL) return -1;
         }
+        if (next & DFA_START) *from = p;
+        id = next & ~DFA_START;
+        p--;
+    }
 
-        memcpy(task->grp, from->grp, sizeof(struct rele_match_t) * ctx->groups);
-        task->sp = from->sp;
-    } else {
-        // Make sure matches are -1 to staret with...
-        for (int i=0; i < ctx->groups; i++) {
-            task->grp[i].rm_so = task->grp[i].rm_eo = (int32_t)-1;
+    // If we got to the start of the text see if we can start there...
+    if (p == start) {
+        struct dstate *s = DSTATE(d, id);
+        if (!s->atend) {
+            int count;
+            s->atend = 1 + dfa_closure(m, d, s, -1, &count);
         }
-        task->sp = TASK_STACK_SIZE;
+        if (s->atend == 2) *from = start;
     }
-    task->next = next;
-    task->last = last;
-    task->n = node;
-    task->p = NULL;
-    return task;
+    return (*from != NULL);
 }
 
-static void inline task_release(struct rectx *ctx, struct task *task) {
-    task->next = ctx->free_list;
-    ctx->free_list = task;
+static int rele_match_iter(struct rematch *m, char *start, int32_t base, char *p, char *end, int flags);
+static int exec_range(struct rematch *m, char *start, char *p, char *end, int flags);
+
+int rele_match(struct rectx *ctx, char *p, int len, int flags) {
+    return rele_exec(ctx->state, p, len, flags);
 }
 
-// Freeing the context is much simpler now since everything was allocated
-// in a block, so we have tasks freeing, successful task freeing and then
-// the main block.
-void rele_free(struct rectx *ctx) {
-    // If we have kept our tasks then they will still be in the free list...
-    while (ctx->free_list) { struct task *x = ctx->free_list->next; free(ctx->free_list); ctx->free_list = x; }
+int rele_match_from(struct rectx *ctx, char *p, int len, int offset, int flags) {
+    return rele_exec_from(ctx->state, p, len, offset, flags);
+}
 
-    // Free the result task if there is one...
-    if (ctx->done) free(ctx->done);
-    free(ctx);
+int rele_match_all(struct rectx *ctx, char *p, int len, int flags, rele_callback fn, void *arg) {
+    return rele_exec_all(ctx->state, p, len, flags, fn, arg);
 }
 
-// Compare the group structures between two tasks to see if they are the same
-// We can do this with memcmp which should be optimised by the compiler given
-// they are word-wide comparisons.
-static inline int has_same_groups(struct rectx *ctx, struct task *a, struct task *b) {
-    if (memcmp(a->grp, b->grp, ctx->groups * sizeof(struct rele_match_t)) == 0) return 1;
-    return 0;
+int rele_match_set(struct rectx *ctx, char *p, int len, int flags, uint32_t *hits, struct rele_match_t *earliest) {
+    return rele_exec_set(ctx->state, p, len, flags, hits, earliest);
 }
 
-// Compare the stack (including sp) on two tasks to see if they are the same
-static inline int has_same_stack(struct rectx *ctx, struct task *a, struct task *b) {
-    if (a->sp != b->sp) return 0;
-    for (int i=a->sp; i < TASK_STACK_SIZE; i++) {
-        if (a->stack[i] != b->stack[i]) return 0;
-    }
-    return 1;
+int rele_exec(struct rematch *m, char *p, int len, int flags) {
+    return exec_range(m, p, p, p + (len ? len : strlen(p)), flags);
 }
 
 /**
- * Task Deduplication ... if we are have matchedsomething, then look at
- * all the tasks that went before us and see if any did the same match and
- * then, if the state is all the same, we can die.
+ * Look for a match starting at or after p + offset. Anything that looks
+ * behind (^, \A, \b, backrefs) still sees the text from p, and the offsets
+ * of the groups are from p too.
  */
-static inline int has_prior_match(struct rectx *ctx, struct task *run_list, struct node *n, struct task *t) {
-    for (struct task *x = run_list; x != t; x = x->next) {
-        if (x->last == n) {
-            if (has_same_groups(ctx, x, t) && has_same_stack(ctx, x, t)) return 1;
-        }
+int rele_exec_from(struct rematch *m, char *p, int len, int offset, int flags) {
+    char *end = p + (len ? len : strlen(p));
+
+    if (offset < 0 || offset > end - p) return 0;
+    return exec_range(m, p, p + offset, end, flags);
+}
+
+/**
+ * Find all of the non-overlapping matches in the text, calling fn (if there
+ * is one) for each. The callback gets the groups and can return non-zero to
+ * stop early. Returns the number of matches found, or RELE_ME_LIMIT if one
+ * of them hit the step limit (the ones before it have still been called).
+ *
+ * After an empty match we move on a char so we don't find it again.
+ */
+int rele_exec_all(struct rematch *m, char *p, int len, int flags, rele_callback fn, void *arg) {
+    char *end = p + (len ? len : strlen(p));
+    char *q = p;
+    int count = 0;
+    int rc = 0;
+
+    // We need to know where each match ends to find the next, and each one
+    // has to finish before we can look for the next
+    flags &= ~(RELE_NOSUB | RELE_YIELD);
+
+    while (q <= end && (rc = exec_range(m, p, q, end, flags)) > 0) {
+        struct rele_match_t *grp = m->done->grp;
+
+        count++;
+        if (fn && fn(arg, grp, m->ctx->groups)) break;
+        q = p + grp[0].rm_eo + (grp[0].rm_eo == grp[0].rm_so);
     }
-    return 0;
+    return (rc < 0 ? rc : count);
 }
 
 /**
- * In a few places we need to find where the next match occurs, this is a helper function
- * that can do that based on whatever type of node we need to check. Note this only supports
- * a certain set of things.
- * 
- * We try to be as efficient as possible as this might be called in a loop.
+ * Match all of the patterns in a set in one pass over the text. A bit is
+ * set in hits (RELE_SET_WORDS(count) of them) for each pattern that
+ * matched. If earliest is given then it gets the first match of each
+ * pattern to end, or -1 if there wasn't one. We stop as soon as every
+ * pattern has matched. Returns how many patterns matched (or RELE_ME_LIMIT).
+ *
+ * rele_exec() on a set just finds the leftmost match of any of them.
  */
-char *next_match(struct node *n, char *start, char *p, char *end, int icase, struct task *t) {
-    switch (n->op) {
-        case OP_MATCH:
-            if (n->ch1) {
-                if (icase) {
-                    for (; p <= end; p++) { if (n->ch1 == fast_tolower(*p)) return p; }                            
-                } else {
-                    for (; p <= end; p++) { if (n->ch1 == *p) return p; }
-                }
-            } else {
-                // Special char match, performance nightmare...
-                for (; p <= end; p++) { if (matchone(n->ch2, *p)) return p; }
-            }
-            return NULL;
+int rele_exec_set(struct rematch *m, char *p, int len, int flags, uint32_t *hits, struct rele_match_t *earliest) {
+    int count = m->ctx->set_count;
+
+    if (!count) return 0;
+    memset(hits, 0, RELE_SET_WORDS(count) * sizeof(uint32_t));
+    for (int i = 0; earliest && i < count; i++) earliest[i].rm_so = earliest[i].rm_eo = -1;
+
+    m->hits = hits;
+    m->earliest = earliest;
+    m->hit_count = 0;
+    int rc = exec_range(m, p, p, p + (len ? len : strlen(p)), flags & ~RELE_YIELD);
+    m->hits = NULL;
+    m->earliest = NULL;
+    return (rc < 0 ? rc : m->hit_count);
+}
 
-        case OP_MATCHSTR:
-            if (icase) {
-                return (rele_strifind(p, end - p, n->string, n->len));
-            } else {
-                return (memmem(p, end - p, n->string, n->len));
-            }
+/**
+ * Match against the text between start and end, with the first match
+ * allowed to start at p.
+ */
+static int exec_range(struct rematch *m, char *start, char *p, char *end, int flags) {
+    int anchored = (m->ctx->anchored || HAS_FLAG(flags, RELE_ANCHORED | RELE_FULLMATCH));
 
-        case OP_MATCHSET:
-            for (; p <= end; p++) {
-                if (match_set(*p, n->set)) return p;
-            }
-            return NULL;
+    // If we have a result left over from a prior run, free it.
+    if (m->done) { task_release(m, m->done); m->done = NULL; }
+    if (m->stream || m->resume.active) stream_stop(m);
+    stats_reset(m);
+
+    // Where we found the required char last time means nothing for this text
+    // (the reverse DFA skips finding it again, find_start() does it then)
+    m->req_hit = NULL;
+
+    // A pattern that starts with \A can't match anywhere else
+    if (m->ctx->anchored && p != start) return 0;
+
+    // If we can only match at the end then check the tail first, backwards,
+    // that tells us if we match and where the leftmost match starts.
+    if (m->rdfa && m->ctx->tail && (m->ctx->tail == TAIL_END || !memchr(start, '\n', end - start))) {
+        char *from;
+        int rc = dfa_rexec(m, start, end, &from);
+        if (rc == 0 || (rc > 0 && anchored && from > p)) return 0;
+        if (rc > 0 && from >= p) {
+            if (HAS_FLAG(flags, RELE_NOSUB)) return 1;
+            p = from;
+            goto tasks;
+        }
+    }
 
-        case OP_ANCHOR:
-            switch (n->ch1) {
-                case 'A':   if (p == start) { return p; } else { return NULL; }
-                case 'Z':   return end;
-                case '^':   if (p == start) return p;
-                            p = memchr(p, '\n', (size_t)(end - p));
-                            if (!p || p == end) return NULL;
-                            return (char *)(p + 1);
-                case '$':   if (p == end) return end;
-                            p = memchr(p, '\n', (size_t)(end - p));
-                            if (!p) return end;
-                            return p;
-                default:    //fprintf(stderr, "INVALID FIRST MATCH ANCHOR [%c]\n", n->ch1);
-                            return p;
-            }
-            // We only cater for specific types here...
-            // TODO
-            return NULL;
+    // No point going any further if we don't have the required char...
+    if (m->ctx->req && !find_req(m, p + m->ctx->req_min, end)) return 0;
+
+    // If we can use the DFA it will quickly tell us if there's no match, and
+    // if the caller doesn't want the groups then that's all we need. If they
+    // do then it also tells us how far along the tasks can start.
+    if (m->dfa) {
+        char *from;
+        int mode = (anchored ? DFA_ANCHORED : 0) | (HAS_FLAG(flags, RELE_FULLMATCH) ? DFA_FULL : 0);
+        int rc = dfa_exec(m, start, p, end, &from, mode);
+        if (rc == 0) return 0;
+        if (rc > 0) {
+            if (HAS_FLAG(flags, RELE_NOSUB)) return 1;
+            p = from;
+        }
+    }
 
-        case OP_MATCHGRP:
-            if (!t) return NULL;
-            char *string = p + t->grp[n->group].rm_so;
-            int len = t->grp[n->mgrp].rm_eo - t->grp[n->mgrp].rm_so;
-            if (icase) {
-                return (rele_strifind(p, end - p, string, len));
-            } else {
-                return (memmem(p, end - p, string, len));
-            }
+    // A single pass over the text tries every start position, with the
+    // native code if we have it (it gives up if it can't get the memory)
+tasks:
+    if (m->ctx->jit) {
+        int rc = jit_exec(m, start, p, end, flags);
+        if (rc != JIT_NOMEM) return rc;
     }
-    return NULL;
+    return rele_match_iter(m, start, 0, p, end, flags);
 }
 
+/**
+ * Carry on with a match that returned RELE_ME_INPROGRESS, it gets another
+ * lot of steps and returns the same as the match would have. Returns 0 if
+ * there's nothing to carry on with.
+ */
+int rele_exec_resume(struct rematch *m) {
+    struct resume *r = &m->resume;
+    if (!r->active) return 0;
+
+    int rc = (r->jit ? jit_exec(m, r->start, r->p, r->end, r->flags) :
+                                        rele_match_iter(m, r->start, 0, r->p, r->end, r->flags));
+    if (rc == JIT_NOMEM) { stream_stop(m); rc = 0; }
+    return rc;
+}
 
-static int rele_match_iter(struct rectx *ctx, char *start, char *p, char *end, int flags);
+int rele_match_resume(struct rectx *ctx) {
+    return rele_exec_resume(ctx->state);
+}
 
-int rele_match(struct rectx *ctx, char *p, int len, int flags) {
-    char *start = p;
-    char *end = p + (len ? len : strlen(p));
-    struct node *n = ctx->fast_start;
 
-        // Used for caseless matching
-    int icase = ctx->flags & RELE_CASELESS;
+// -------------------------------------------------------------------------------
+// STREAMING
+// -------------------------------------------------------------------------------
+//
+// For data that arrives in pieces (a UART or a socket) the task matcher can
+// keep its run list between chunks, so each char is only looked at once and
+// nothing needs to keep the old data. The ctx needs RELE_STREAM so there are
+// no strings, backreferences or DOTSTAR searches that would look ahead.
+//
+// Once a chunk finishes a match the stream carries on from the end of it, so
+// the caller needs to feed the data from rm_eo again.
 
-    if (n) {
-        if (n->op == OP_DOTSTAR || n->op == OP_DOTPLUS) {
-            // This is a special case, we only call rele_match_iter once as the .* or .+ will match everything
-            if (rele_match_iter(ctx, start, p, end, flags)) return 1;
-        } else {
-            for (; p <= end; p++) {
-                p = next_match(n, start, p, end, icase, NULL);
-                if (!p) return 0;
-                if (rele_match_iter(ctx, start, p, end, flags)) return 1;
-            }
-        }
-    } else {
-        // Otherwise we have to resort to testing at each point...
-        for (; p <= end; p++) {
-            if (rele_match_iter(ctx, start, p, end, flags)) return 1;
-        }
+/**
+ * Start matching against a stream, flags are the match flags. Returns 0 if
+ * the ctx wasn't compiled for streaming.
+ */
+int rele_stream_begin(struct rematch *m, int flags) {
+    if (NOT_FLAG(m->ctx->flags, RELE_STREAM)) return 0;
+
+    if (m->done) { task_release(m, m->done); m->done = NULL; }
+    stream_stop(m);
+    stats_reset(m);
+
+    m->offset = 0;
+    m->cand = 0;
+    m->sflags = flags;
+    m->pc = 0;
+    m->stream = STREAM_ON;
+    return 1;
+}
+
+static int stream_run(struct rematch *m, char *p, int len, int more) {
+    if (NOT_FLAG(m->stream, STREAM_ON)) return 0;
+
+    // If we finished a match last time then start again at the end of it, not
+    // finding the same empty match again...
+    if (HAS_FLAG(m->stream, STREAM_MATCHED)) {
+        struct rele_match_t *grp = m->done->grp;
+        m->offset = grp[0].rm_eo;
+        m->cand = grp[0].rm_eo + (grp[0].rm_eo == grp[0].rm_so);
+        m->pc = m->done_pc;
+        task_release(m, m->done);
+        m->done = NULL;
     }
-    if (NOT_FLAG(flags, RELE_KEEP_TASKS)) {
-        while (ctx->free_list) { struct task *x = ctx->free_list->next; free(ctx->free_list); ctx->free_list = x; }
+    m->stream = STREAM_ON | more;
+
+    // Positions are worked out from the offset of the chunk, so they come out
+    // as offsets into the stream. If we run out of steps there's no way to
+    // carry on, so that's the end of the stream.
+    int rc = rele_match_iter(m, p, m->offset, p, p + len, m->sflags);
+    if (rc < 0) { stream_stop(m); return rc; }
+    if (rc) {
+        m->stream |= STREAM_MATCHED;
+        return 1;
     }
+    m->offset += len;
+    if (len) m->pc = p[len - 1];
     return 0;
 }
 
+/**
+ * Feed the next chunk of the stream, returns 1 if that finishes a match. A
+ * match that could still get longer (or be beaten by one that started
+ * earlier) has to wait for more. RELE_ME_LIMIT ends the stream.
+ */
+int rele_stream_feed(struct rematch *m, char *p, int len) {
+    return stream_run(m, p, len, STREAM_MORE);
+}
 
 /**
- * Regular expression matching, returns 1 if a match is found or
- * 0 if not.
+ * There's no more to come, returns 1 if that finishes a match. As with a
+ * chunk, the stream then carries on from the end of the match.
  */
-//static int rele_match_iter(struct rectx *ctx, char *p, int len, int flags) {
-static int rele_match_iter(struct rectx *ctx, char *start, char *p, char *end, int flags) {
-    tcount = 0;
+int rele_stream_end(struct rematch *m) {
+    int rc = stream_run(m, "", 0, 0);
+    if (rc) return rc;
 
-    // If we have a result left over from a prior run, free it.
-    if (ctx->done) { task_release(ctx, ctx->done); ctx->done = NULL; }
+    stream_stop(m);
+    return 0;
+}
 
-    // Create the first task on the list...
-    struct task *run_list = task_new(ctx, NULL, NULL, NULL, ctx->root);
+/**
+ * The offset of the first byte a match could still include (or that the
+ * last match started at), anything before it can be thrown away.
+ */
+int32_t rele_stream_keep(struct rematch *m) {
+    int32_t keep = m->offset;
+
+    for (struct task *t = m->run_list; t; t = t->next) {
+        if (t->grp[0].rm_so >= 0 && t->grp[0].rm_so < keep) keep = t->grp[0].rm_so;
+    }
+    if (m->done && m->done->grp[0].rm_so < keep) keep = m->done->grp[0].rm_so;
+    return keep;
+}
+
+/**
+ * Regular expression matching, returns 1 if a match is found, 0 if not or
+ * RELE_ME_LIMIT if we ran out of steps first.
+ *
+ * This is a single pass over the text, rather than starting again at each
+ * position we add a new task (at the lowest priority) at each place a match
+ * could start, so earlier starts always win. Once something completes there
+ * is no point starting anything new.
+ *
+ * With a stream the text is one chunk, start is where it starts and base is
+ * its offset in the stream (0 otherwise). If there's more to come then at the
+ * end of the chunk anything that needs the next char stays where it is, and
+ * the run list is kept for the next chunk.
+ */
+// Where the loop a task is in last went round, an iteration that ends where
+// it started matched nothing so it's time to leave
+#define LOOP(t)         TASK_LOOPS(ctx, t)[(t)->lp]
+#define POS(p)          ((int32_t)((p) - start) + base)
+
+// At the start of the text (or stream), and the char before p which could be
+// in the last chunk of a stream
+#define AT_START(p)     ((p) == start && !base)
+#define PREV_CH(p)      (((p) == start) ? (base ? m->pc : 0) : (p)[-1])
+
+// A copy of t goes in after it, if the slab has run out then we give up
+#define SPAWN(last, node)   do { struct task *s = task_new(m, t, t->next, (last), (node)); \
+                                 if (!s) goto over; \
+                                 t->next = s; } while (0)
+
+// Nothing goes above the root, so any link we follow here is there and we
+// don't need to check for 0
+#define GO_A(n)         ((n) + (n)->a)
+#define GO_B(n)         ((n) + (n)->b)
+#define GO_UP(n)        ((n) + (n)->parent)
+#define GO_MATCH(n)     ((n) + (n)->match)
+
+static int rele_match_iter(struct rematch *m, char *start, int32_t base, char *p, char *end, int flags) {
+    struct rectx *ctx = m->ctx;
+
+    // The run list starts empty, tasks are added as we find start points
+    struct task *run_list = NULL;
 
     // Keep track of the previous one so we can remove items
     struct task *prev = NULL;
     struct task *t;
 
-    // Used to tracking zero length matches
-    uint32_t    iter = 0;
-    struct task *expected;
-
     // Used for caseless matching
     int icase = ctx->flags & RELE_CASELESS;
 
+    // Work out where the first match could start, if we have a fast_start then
+    // use it, a leading .* or .+ (or being anchored) means we only ever need to
+    // start once.
+    struct node *fs = ctx->fast_start;
+    int         seed = 1;
+    int         full = HAS_FLAG(flags, RELE_FULLMATCH);
+    int         once = (fs && (fs->op == OP_DOTSTAR || fs->op == OP_DOTPLUS));
+    char        *cand = p;
+
+    // If the caller has set a limit, how far we've got towards it. If we
+    // can yield then it's how far we go before stopping for a while instead.
+    int         yield = HAS_FLAG(flags, RELE_YIELD) && !m->stream;
+    uint32_t    limit = (yield ? 0 : m->limit);
+    uint32_t    slice = (yield ? m->limit : 0);
+    uint32_t    steps = 0;
+
+    // For a stream, where this chunk starts and if we are waiting for more
+    char        *chunk = NULL;
+    int         hold = 0;
+
+    if (m->resume.active) {
+        // Carry on from where we yielded...
+        run_list = m->run_list;
+        m->run_list = NULL;
+        cand = m->resume.cand;
+        seed = m->resume.seed;
+        once = m->resume.once;
+        m->resume.active = 0;
+    } else if (m->stream) {
+        // Carry on from where the last chunk got to...
+        chunk = p;
+        run_list = m->run_list;
+        m->run_list = NULL;
+        once = (ctx->anchored || HAS_FLAG(flags, RELE_ANCHORED | RELE_FULLMATCH));
+        seed = (m->cand >= 0);
+        if (seed) cand = (once ? start + (m->cand - base) : stream_start(m, start + (m->cand - base), end));
+    } else {
+        if (ctx->anchored || HAS_FLAG(flags, RELE_ANCHORED | RELE_FULLMATCH)) {
+            if (ctx->anchored && p != start) return 0;
+            once = 1;
+        }
+
+        if (!once) {
+            cand = next_start(m, fs, start, p, end, icase);
+            if (!cand) return 0;
+        }
+    }
+
     do {
-        // Get ready to run through for this char...
+        // We only stop between chars, so there's no task part way through
+        if (slice && steps >= slice) goto pause;
+
+        // If we have nothing running then skip straight to the next start point
+        if (!run_list) {
+            if (!seed) goto done;
+            p = cand;
+            if (p > end) break;
+        }
+        // Get ready to run through for this char, a new generation means
+        // nothing has matched anything at this position yet...
+        if (!++m->gen) { memset(m->seen, 0, ctx->node_count * sizeof(uint32_t)); m->gen = 1; }
         t = run_list;
-        if (!t) goto done;
 
         char ch;
         if (p < end) {
             ch = (icase ? fast_tolower(*p) : *p);
         } else {
             ch = 0;
+            hold = HAS_FLAG(m->stream, STREAM_MORE);
         }
         prev = NULL;
 
-        expected = t;
-
         // Now for each task go through the binary tree until we get to
         // a match type op, then we either die (match failed), or we stay
         // for next time.
-        while (t) {
+        while (1) {
+            // At the end of the list, this is where a new start goes (if
+            // this is a candidate position)...
+            if (!t) {
+                if (!seed || p != cand) break;
+                t = task_new(m, NULL, NULL, NULL, ctx->root);
+                if (!t) goto over;
+                STAT_ADD(m, starts, 1);
+                if (prev) { prev->next = t; } else { run_list = t; }
+
+                // Work out the next start position
+                if (once) {
+                    seed = 0;
+                } else if (chunk) {
+                    cand = stream_start(m, p + 1, end);
+                } else {
+                    cand = (p < end) ? next_start(m, fs, start, p + 1, end, icase) : NULL;
+                    if (!cand) seed = 0;
+                }
+            }
+
             // TODO: We could do a fast wait here for any tasks waiting for a
             //       particular p value. It means moving p into it's own task
             //       variable.
-            // HOw does that affect iter below? I think it would break it
-            // which means we'll be slower than we could be.
             if (t->p) {
-                if (t->p != p) { prev = t; t = t->next; continue; }
+                if (!t->n) goto die;        // replaced by a higher priority waiter
+                if (t->p != p) { t->gen = m->gen; prev = t; t = t->next; continue; }
                 t->p = NULL;
             }
 
-            // This is attempting to increase iter for every task but taking
-            // into account child tasks and not incrememnting for them. It basically
-            // looks at what's coming next, and then only increments iter when it
-            // gets there, so any children should be ignored on the first time around.
-            if (t == expected) {
-                iter++;
-                expected = t->next;
-                if (expected == NULL) expected = run_list;
-            }
+            steps++;
+            STAT_ADD(m, steps, 1);
+            if (limit && steps > limit) goto over;
 
             struct node *n = t->n;
+            HEAT_ADD(m, n, visits, 1);
 
             // Probablt the most likely... although less so with OP_MATCHSTR support
             if (n->op == OP_CONCAT) {
-                if (t->last == n->a) goto leg_b;
-                if (t->last == n->b) goto parent;
+                if (t->last == GO_A(n)) goto leg_b;
+                if (t->last == GO_B(n)) goto parent;
                 goto leg_a;
             }
 
@@ -1287,24 +4154,28 @@ static int rele_match_iter(struct rectx *ctx, char *start, char *p, char *end, i
 
             // Probably the second most likely...
             if (n->op == OP_MATCH) {
-                if (!ch) goto die;      // can't match NULL
-                if ((n->ch1 && (n->ch1 == ch)) || (!n->ch1 && matchone(n->ch2, ch))) {
-                    if (has_prior_match(ctx, run_list, n, t)) goto die;
+                if (!ch) {              // can't match NULL
+                    if (hold) goto next;
+                    goto die;
+                }
+                if ((n->ch1 && (n->ch1 == ch)) || (!n->ch1 && matchone(n->cls, ch))) {
+                    if (has_prior_match(m, run_list, n, t)) goto die;
                     goto match_ok;
                 }
                 goto die;
             }
 
             if (n->op == OP_MATCHSTR) {
-                if (t->last == n->parent) {
+                if (t->last == GO_UP(n)) {
                     // Ok, we need to do the comparison, and then either die or setup
                     // to hang around to the right end point.
+                    if (end - p < n->len) goto die;
                     if (icase) {
-                        if (!rele_strncasecmp(n->string, p, n->len)) goto die;
+                        if (!rele_strncasecmp(NODE_STR(n), p, n->len)) goto die;
                     } else {
-                        if (memcmp(n->string, p, n->len) != 0) goto die;
+                        if (memcmp(NODE_STR(n), p, n->len) != 0) goto die;
                     }
-                    if (has_prior_match(ctx, run_list, n, t)) goto die;
+                    if (has_prior_match(m, run_list, n, t)) goto die;
                     // We need to stay here
                     t->last = n;
                     t->p = p + n->len - 1;
@@ -1319,72 +4190,89 @@ static int rele_match_iter(struct rectx *ctx, char *start, char *p, char *end, i
             // from b, then it was successful and we spawn. Who goes where depends
             // on if we are lazy or not...
             if (n->op == OP_PLUS) {
-                if (t->last == n->parent) {
-                    n->iter = iter;
+                if (t->last == GO_UP(n)) {
+                    t->lp--;
+                    LOOP(t) = POS(p);
                     goto leg_b;
                 }
-                if (n->iter == iter) goto parent;       // zero length match
-                n->iter = iter;
-                goto new_b_or_parent;
+                if (LOOP(t) == POS(p)) { t->lp++; goto parent; }    // zero length match
+                LOOP(t) = POS(p);
+                goto new_b_or_loop_parent;
             }
 
             // If we get here from above, we spawn to go back (zero) then we go
             // down b. If we get here from b, then carry on back up.
             if (n->op == OP_QUESTION) {
-                if (t->last == n->b) goto parent;
+                if (t->last == GO_B(n)) goto parent;
                 goto new_b_or_parent;
             }
 
             // If we hit from above then spawn to go right back up (zero) and from
             // b we do the same.
             if (n->op == OP_STAR) {
-                if (t->last == n->parent) {
-                    n->iter = iter;
-                } else {
-                    if (n->iter == iter) goto parent;    // zero length match
-                    n->iter = iter;
+                if (t->last == GO_UP(n)) {
+                    t->lp--;
+                } else if (LOOP(t) == POS(p)) {
+                    t->lp++;
+                    goto parent;                        // zero length match
                 }
-                goto new_b_or_parent;
+                LOOP(t) = POS(p);
+                goto new_b_or_loop_parent;
             }
 
             if (n->op == OP_DOTPLUS) {
                 if (n->match) {
                     // First time we do the first dot (because fo plus)...
-                    if (t->last == n->parent) {
+                    if (t->last == GO_UP(n)) {
                         if (!ch) goto die;
+                        if (has_prior_match(m, run_list, n, t)) goto die;
                         t->last = NULL;
                         goto next;
                     }
                     // last=NULL is our main matcher...
                     if (t->last == NULL) {
-                        t->p = next_match(n->match, start, p, end, icase, t);
+                        t->p = next_match(GO_MATCH(n), start, p, end, icase, t);
                         if (!t->p) goto die;
-                        if (t->p != p) { t->last = n; goto next; }      // wait
+                        if (t->p != p) {                                // wait
+                            if (has_prior_waiter(m, n, t)) goto die;
+                            t->last = n;
+                            goto next;
+                        }
                         t->p = NULL;    // drop through
                     }
                     // When we reach the match...
                     if (n->lazy) {
-                        t->next = task_new(ctx, t, t->next, NULL, n);
-                        // TODO: could this get stuck? I do't think so because the match worked
-                        // what if it was a $ or somethign like that??
-                        t->next->p = p + 1;     // wait for one, quicker than using t->last= parent?
+                        if (ch && !has_prior_match(m, run_list, n, t)) {
+                            SPAWN(NULL, n);
+                            t->took = NULL;         // the new one is what consumed
+                            // TODO: could this get stuck? I do't think so because the match worked
+                            // what if it was a $ or somethign like that??
+                            t->next->p = p + 1;     // wait for one, quicker than using t->last= parent?
+                        }
                         goto parent; 
                     } else {
-                        t->next = task_new(ctx, t, t->next, n, n->parent);
+                        SPAWN(n, GO_UP(n));
+                        if (!ch) goto die;
+                        if (has_prior_match(m, run_list, n, t)) goto die;
                         t->last = NULL;
                         goto next;
                     }
                 }
                 // Normal operation without forward matching...
-                if (t->last != n->parent) {
+                if (t->last != GO_UP(n)) {
                     if (n->lazy) {
-                        t->next = task_new(ctx, t, t->next, n->parent, n);
+                        SPAWN(GO_UP(n), n);
                         goto parent;
                     } else {
-                        t->next = task_new(ctx, t, t->next, n, n->parent);
+                        SPAWN(n, GO_UP(n));
                     }
                 }
-                if (!ch) goto die;
+                if (!ch) {
+                    // Waiting for the next chunk, but we've already spawned
+                    if (hold) { t->last = GO_UP(n); goto next; }
+                    goto die;
+                }
+                if (has_prior_match(m, run_list, n, t)) goto die;
                 t->last = n;
                 goto next;
             }
@@ -1393,36 +4281,51 @@ static int rele_match_iter(struct rectx *ctx, char *start, char *p, char *end, i
             if (n->op == OP_DOTSTAR) {
                 // If t->last is NULL, then we are a lazy sub-task...
                 if (t->last == NULL) {
-                    if (!ch) goto die;
-                    t->last = n->parent;
+                    if (!ch) {
+                        if (hold) goto next;
+                        goto die;
+                    }
+                    if (has_prior_match(m, run_list, n, t)) goto die;
+                    t->last = GO_UP(n);
                     goto next;
                 }
 
                 // Let's handle the match case first...
                 if (n->match) {
-                    if (t->last == n->parent) {
-                        t->p = next_match(n->match, start, p, end, icase, t);
+                    if (t->last == GO_UP(n)) {
+                        t->p = next_match(GO_MATCH(n), start, p, end, icase, t);
                         if (!t->p) goto die;
-                        if (t->p != p) { t->last = n; goto next; }      // immediate match .. drop through
-                        t->p = NULL; // fall througg
+                        if (t->p != p) {                                // wait
+                            if (has_prior_waiter(m, n, t)) goto die;
+                            t->last = n;
+                            goto next;
+                        }
+                        t->p = NULL; // immediate match .. drop through
                     }
                     // If we get here then we've got to the start of the match
                     if (n->lazy) {
-                        t->next = task_new(ctx, t, t->next, NULL, n);
+                        SPAWN(NULL, n);
                         goto parent;
                     } else {
-                        t->next = task_new(ctx, t, t->next, n, n->parent);
-                        t->last = n->parent;
+                        SPAWN(n, GO_UP(n));
+                        if (!ch) goto die;
+                        if (has_prior_match(m, run_list, n, t)) goto die;
+                        t->last = GO_UP(n);
                         goto next;
                     }
                 }
                 // Default case ... act as a normal .* and .*?
                 if (n->lazy) {
-                    t->next = task_new(ctx, t, t->next, NULL, n);
+                    SPAWN(NULL, n);
                     goto parent;
                 } else {
-                    t->next = task_new(ctx, t, t->next, n, n->parent);
-                    if (!ch) goto die;
+                    SPAWN(n, GO_UP(n));
+                    if (!ch) {
+                        // Waiting for the next chunk, but we've already spawned
+                        if (hold) { t->last = NULL; goto next; }
+                        goto die;
+                    }
+                    if (has_prior_match(m, run_list, n, t)) goto die;
                     t->last = n;
                     goto next;
                 }
@@ -1432,20 +4335,20 @@ from_GROUP:
             // If we hit an empty group, then make sure we haven't just hit it,
             // in which case we die otherwise we proceed back up to the parent
             if (n->op == OP_GROUP) {
-                if (n->b == NOTUSED) {
-                    t->n = n->parent;
+                if (EMPTY_GROUP(n)) {
+                    t->n = GO_UP(n);
                     t->last = n;
-                    t->grp[n->group].rm_so = t->grp[n->group].rm_eo = (int32_t)(p - start);
+                    if (n->group != NO_GROUP) t->grp[n->group].rm_so = t->grp[n->group].rm_eo = POS(p);
                     continue;
                 }
-                if (t->last == n->b) {
+                if (t->last == GO_B(n)) {
                     // On the way back up... fill in the length
-                    t->n = n->parent;
-                    if (n->group != NO_GROUP) { t->grp[n->group].rm_eo = (int32_t)(p - start); }
+                    t->n = GO_UP(n);
+                    if (n->group != NO_GROUP) { t->grp[n->group].rm_eo = POS(p); }
                 } else {
                     // Going down leg b... mark the start
-                    t->n = n->b;
-                    if (n->group != NO_GROUP) { t->grp[n->group].rm_so = (int32_t)(p - start); }
+                    t->n = GO_B(n);
+                    if (n->group != NO_GROUP) { t->grp[n->group].rm_so = POS(p); }
                 }
                 t->last = n;
                 continue;
@@ -1454,70 +4357,96 @@ from_GROUP:
             // If we get here from above then spin off a new task to go down leg b
             // and we go down leg a. Anything coming back up, goes to the parent.
             if (n->op == OP_ALTERNATE) {
-                if (t->last == n->parent) {
-                    t->next = task_new(ctx, t, t->next, n, n->b);
+                if (t->last == GO_UP(n)) {
+                    SPAWN(n, GO_B(n));
                     goto leg_a;
                 }
                 goto parent;
             }
 
             // If we get to OP_DONE then we are done, but there might be other
-            // tasks to continue. We keep the first task completed at each index,
-            // then overwrite for the next one.
+            // tasks to continue.
             //
-            // However, since the tasks are prioritised based on lazyness etc, then
-            // if there are no tasks before us, then we are the one!
+            // Since the tasks are prioritised (based on start position, lazyness
+            // etc) anything after us can never win so they all go, as does any
+            // previous candidate (which must have been lower priority). Anything
+            // before us gets to continue and might replace us later. If there
+            // are no tasks before us, then we are the one!
             //
             if (n->op == OP_DONE) {
-                // If we have already completed at this index, then die...
-                if (ctx->done && ctx->done->p == p) goto die;
+                // A full match has to use all of the text
+                if (full) {
+                    if (hold) goto next;
+                    if (p != end) goto die;
+                }
+
+                // A set has a DONE for each pattern inside group 0, so that's
+                // where the match ends
+                if (ctx->set_count) t->grp[0].rm_eo = POS(p);
+
+                // For a set we just note which pattern this is and keep going
+                // for the others, the first to get here is the earliest.
+                if (m->hits) {
+                    uint32_t bit = 1u << (n->id & 31);
+                    if (NOT_FLAG(m->hits[n->id >> 5], bit)) {
+                        m->hits[n->id >> 5] |= bit;
+                        if (m->earliest) m->earliest[n->id] = t->grp[0];
+                        if (++m->hit_count == ctx->set_count) goto done;
+                    }
+                    goto die;
+                }
 
                 // Free the previous candidate if there was one...
-                if (ctx->done) task_release(ctx, ctx->done);
+                if (m->done) task_release(m, m->done);
+
+                // Cut off everything with a lower priority...
+                while (t->next) { struct task *x = t->next; t->next = x->next; task_release(m, x); }
 
                 // Prep and store as the candidate...
                 t->p = p;
-                ctx->done = t;
+                m->done = t;
+                seed = 0;
+                if (chunk) m->done_pc = PREV_CH(p);
 
                 // If we are the top of the task list we are completetly done
                 if (run_list == t) {
-                    run_list = t->next;
-                    t->next = NULL;
+                    run_list = NULL;
                     goto done;
                 }
-                // Otherwise we aren't top, so go to next task...
-                prev->next = t->next;
-                t->next = NULL;
-                t = prev->next;
-                continue;
+                // Otherwise we aren't top, so we've finished with this char...
+                prev->next = NULL;
+                break;
             }
 
             // CHeck for a ghost match on these...
             if (n->op == OP_ANCHOR) {
+                // Anything that needs the next char has to wait for it
+                if (hold && n->ch1 != 'A' && n->ch1 != '^') goto next;
+
                 switch (n->ch1) {
-                    case 'b':       if (p == start) {
-                                        if (isalnum((int)*p)) goto parent;
+                    case 'b':       if (AT_START(p)) {
+                                        if (is_word(*p)) goto parent;
                                     } else if (p == end) {
-                                        if (isalnum((int)p[-1])) goto parent;
-                                    } else if (isalnum((int)p[-1]) ^ isalnum((int)p[0])) {
+                                        if (is_word(PREV_CH(p))) goto parent;
+                                    } else if (is_word(PREV_CH(p)) ^ is_word(p[0])) {
                                         goto parent;
                                     }
                                     goto die;
-                    case 'B':       if (p == start) {
-                                        if (!isalnum((int)*p)) goto parent;
+                    case 'B':       if (AT_START(p)) {
+                                        if (!is_word(*p)) goto parent;
                                     } else if (p == end) {
-                                        if (!isalnum((int)p[-1])) goto parent;
-                                    } else if (!(isalnum((int)p[-1]) & isalnum((int)p[0]))) {
+                                        if (!is_word(PREV_CH(p))) goto parent;
+                                    } else if (!(is_word(PREV_CH(p)) ^ is_word(p[0]))) {
                                         goto parent;
                                     }
                                     goto die;
-                    case 'A':       if (p == start) goto parent;
+                    case 'A':       if (AT_START(p)) goto parent;
                                     goto die;
                     case 'Z':       if (p == end) goto parent;
                                     goto die;
 
-                    case '^':       if (p == start) goto parent; 
-                                    if (p[-1] == '\n') goto parent;
+                    case '^':       if (AT_START(p)) goto parent;
+                                    if (PREV_CH(p) == '\n') goto parent;
                                     goto die;
                     case '$':       if (p == end) goto parent;
                                     if (*p == '\n') goto parent;
@@ -1530,17 +4459,18 @@ from_GROUP:
             // TODO: ch is already lower() if icase, which is a waste
             //       could we do it later/here?
             if (n->op == OP_MATCHSET) {
-                if (match_set(ch, n->set)) {
-                    if (has_prior_match(ctx, run_list, n, t)) goto die;
+                if (hold) goto next;
+                if (match_set(ch, NODE_SET(n))) {
+                    if (has_prior_match(m, run_list, n, t)) goto die;
                     t->last = n;
-                    t->n = n->parent;
+                    t->n = GO_UP(n);
                     goto next;
                 }
                 goto die;
             }
 
             if (n->op == OP_MATCHGRP) {
-                if (t->last == n->parent) {
+                if (t->last == GO_UP(n)) {
                     // Ok, we need to do the comparison, and then either die or setup
                     // to hang around to the right end point.
                     int len = t->grp[n->mgrp].rm_eo - t->grp[n->mgrp].rm_so;
@@ -1556,16 +4486,17 @@ from_GROUP:
                         } else {
                             if (*grpstr != *p) goto die;
                         }
-                        if (has_prior_match(ctx, run_list, n, t)) goto die;
+                        if (has_prior_match(m, run_list, n, t)) goto die;
                         goto match_ok;
                     }
                     // String match...
+                    if (end - p < len) goto die;
                     if (icase) {
                         if (!rele_strncasecmp(grpstr, p, len)) goto die;
                     } else {
                         if (memcmp(grpstr, p, len) != 0) goto die;
                     }
-                    if (has_prior_match(ctx, run_list, n, t)) goto die;
+                    if (has_prior_match(m, run_list, n, t)) goto die;
                     // We need to stay here
                     t->last = n;
                     t->p = p + len - 1;
@@ -1579,41 +4510,44 @@ from_GROUP:
             //
             // Need to ensure that a zero min doesn't get killed. Check from coming from b.
             if (n->op == OP_MULT) {
-                if (t->last == n->parent) {
-                    if (t->sp == 0) {
-                        // TODO: stack error
-                        //fprintf(stderr, "stack nesting too deep.\n");
-                        goto die;
-                    }
+                uint16_t *stack = TASK_STACK(ctx, t);
+
+                // The compiler sized the stack for every counter, so there's
+                // always room
+                if (t->last == GO_UP(n)) {
                     t->sp--;
-                    t->stack[t->sp] = 0;
-                    n->iter = iter;
+                    stack[t->sp] = 0;
+                    t->lp--;
                 }
-                // If we come from below and have a zero length, then
-                // we can consider this all done.
-                if (t->last == n->b) {
-                    if (n->iter == iter) { t->sp++; goto parent; }
-                    n->iter = iter;
+                // If we come from below and an optional go round matched
+                // nothing then we can consider this all done.
+                if (t->last == GO_B(n)) {
+                    if (stack[t->sp] > n->min && LOOP(t) == POS(p)) { t->sp++; t->lp++; goto parent; }
                 }
+                LOOP(t) = POS(p);
 
                 // If we've hit max, then go back up...
-                if (t->stack[t->sp] == n->max) { t->sp++; goto parent; }
+                if (stack[t->sp] == n->max) { t->sp++; t->lp++; goto parent; }
 
-                // Normal op .. inc if under absolute max
-                if (t->stack[t->sp] < NO_MAX) t->stack[t->sp]++;
+                // Normal op .. inc if under max, if there is no max then once we
+                // are past min all counts behave the same, so don't go further
+                // and tasks can be deduplicated.
+                if (stack[t->sp] <= n->min || n->max != NO_MAX) stack[t->sp]++;
                 
                 // If we haven't hit min, then do b again...
-                if (t->stack[t->sp] <= n->min) goto leg_b;
+                if (stack[t->sp] <= n->min) goto leg_b;
 
                 // We must have hit min, so need to spawn...
                 if (n->lazy) {
-                    t->next = task_new(ctx, t, t->next, n, n->b);
-                    t->n = n->parent;
+                    SPAWN(n, GO_B(n));
+                    t->n = GO_UP(n);
                     t->sp++;        // parent
+                    t->lp++;
                 } else {
-                    t->next = task_new(ctx, t, t->next, n, n->parent);
+                    SPAWN(n, GO_UP(n));
                     t->next->sp++;  // parent
-                    t->n = n->b;
+                    t->next->lp++;
+                    t->n = GO_B(n);
                 }
                 t->last = n;
                 continue;
@@ -1622,14 +4556,17 @@ from_GROUP:
             // We always match a LF on either go around, but if not and we come from above then we must
             // match a CR and go again. On the second time around if doesn't matter if we don't match.
             if (n->op == OP_CRLF) {
+                if (hold) goto next;
                 if (ch == 10) {
+                    if (has_prior_match(m, run_list, n, t)) goto die;
                     t->last = n;
-                    t->n = n->parent;
+                    t->n = GO_UP(n);
                     goto next;
                 }
-                if (t->last == n->parent) {
+                if (t->last == GO_UP(n)) {
                     if (ch == 13) {
                         // Stay here for another go...
+                        if (has_prior_match(m, run_list, n, t)) goto die;
                         t->last = n;
                         goto next;
                     }
@@ -1640,24 +4577,32 @@ from_GROUP:
 
 // Reused outcomes for the different operations...
 
-new_b_or_parent:    t->next = task_new(ctx, t, t->next, n, (n->lazy ? n->b : n->parent));
-                    t->n = (n->lazy ? n->parent : n->b);
+new_b_or_parent:    SPAWN(n, (n->lazy ? GO_B(n) : GO_UP(n)));
+                    t->n = (n->lazy ? GO_UP(n) : GO_B(n));
                     t->last = n;
                     continue;
 
-leg_a:              t->n = n->a;
+                    // The same, but the one going up leaves the loop...
+new_b_or_loop_parent:
+                    SPAWN(n, (n->lazy ? GO_B(n) : GO_UP(n)));
+                    if (n->lazy) { t->lp++; } else { t->next->lp++; }
+                    t->n = (n->lazy ? GO_UP(n) : GO_B(n));
                     t->last = n;
                     continue;
 
-leg_b:              t->n = n->b;
+leg_a:              t->n = GO_A(n);
                     t->last = n;
                     continue;
 
-parent:             t->n = n->parent;
+leg_b:              t->n = GO_B(n);
                     t->last = n;
                     continue;
 
-match_ok:           t->n = n->parent;
+parent:             t->n = GO_UP(n);
+                    t->last = n;
+                    continue;
+
+match_ok:           t->n = GO_UP(n);
                     t->last = n;
                     // fall through...
 
@@ -1665,27 +4610,52 @@ next:               prev = t;
                     t = t->next;
                     continue;
 
-die:                if (prev) {
-                        prev->next = t->next; task_release(ctx, t); t = prev->next;
+die:                if (t->n) HEAT_ADD(m, t->n, deaths, 1);
+                    if (prev) {
+                        prev->next = t->next; task_release(m, t); t = prev->next;
                         continue;
                     } else {
-                        run_list = t->next; task_release(ctx, t); t = run_list;
+                        run_list = t->next; task_release(m, t); t = run_list;
                         continue;
                     }
         }
         p++;
     } while(p <= end);
 
+    // If there's more of the stream to come then keep everything for it
+    if (HAS_FLAG(m->stream, STREAM_MORE)) {
+        m->run_list = run_list;
+        m->cand = (seed ? POS(cand) : -1);
+        return 0;
+    }
+
     // Ok, we get here because we've run out of text or we've run out of tasks
     // or both.
 
 done:
+    if (chunk) m->cand = -1;
+
     // Move any tasks left on the run-list into the free list
-    while (run_list) { t = run_list->next; task_release(ctx, run_list); run_list = t; }
+    while (run_list) { t = run_list->next; task_release(m, run_list); run_list = t; }
 
     // And return status...
-    if (ctx->done) return 1;
+    if (m->done) return 1;
     return 0;
+
+    // Out of steps (or tasks), nothing we have so far can be trusted
+    // (something that started earlier might still have beaten it)
+over:
+    if (chunk) m->cand = -1;
+    while (run_list) { t = run_list->next; task_release(m, run_list); run_list = t; }
+    if (m->done) { task_release(m, m->done); m->done = NULL; }
+    return RELE_ME_LIMIT;
+
+    // Out of steps for now, keep everything so we can carry on later
+pause:
+    m->run_list = run_list;
+    m->resume = (struct resume){ .start = start, .p = p, .end = end, .cand = cand, .flags = flags,
+                                 .seed = seed, .once = once, .jit = 0, .active = 1 };
+    return RELE_ME_INPROGRESS;
 }
 
 #include <stdio.h>
@@ -1712,12 +4682,29 @@ static char *opmap(uint8_t op) {
     }
 }
 
-static void dump_dot(struct rectx *ctx, struct node *n, FILE *f) {
+// Finish a node label, with a heatmap we add the counts and colour it by how
+// many visits it had compared to the busiest node (hot).
+static void dot_end(struct rectx *ctx, struct node *n, FILE *f, uint32_t hot) {
+#ifdef RELE_HEATMAP
+    struct heat *h = &ctx->state->heat[NODE_ID(ctx, n)];
+
+    fprintf(f, "\nvisits=%u spawns=%u\ndeaths=%u dedupes=%u\nbytes=%u\"", h->visits, h->spawns,
+                    h->deaths, h->dedupes, h->bytes);
+    fprintf(f, ", style=filled, fillcolor=\"0.000 %.3f 1.000\"];\n", hot ? (double)h->visits / hot : 0.0);
+#else
+    (void)ctx;
+    (void)n;
+    (void)hot;
+    fprintf(f, "\"];\n");
+#endif
+}
+
+static void dump_dot(struct rectx *ctx, struct node *n, FILE *f, uint32_t hot) {
     if (!n) return;
 
     int chars;
 
-#define GEND fprintf(f, "\"];\n")
+#define GEND dot_end(ctx, n, f, hot)
 
 #ifdef DEBUG_ID
     fprintf(f, "    n%p [label=\"(%d)\n%s\n", (void *)n, NODE_ID(ctx, n), opmap(n->op));
@@ -1727,8 +4714,6 @@ static void dump_dot(struct rectx *ctx, struct node *n, FILE *f) {
 
 #define OUTC(c)     if(isprint((int)c)) { fprintf(f, "'%c'", c); } else { fprintf(f, "[0x%02x]", c); }
 
-    fprintf(stderr, "NODEID: %d.  OP=%d\n", NODE_ID(ctx, n), n->op);
-
     switch(n->op) {
         case OP_MATCH:
             if (n->ch1 && n->ch2) {
@@ -1747,7 +4732,7 @@ static void dump_dot(struct rectx *ctx, struct node *n, FILE *f) {
             return;
 
         case OP_MATCHSTR:
-            fprintf(f, "'%.*s'", n->len, n->string);
+            fprintf(f, "'%.*s'", n->len, NODE_STR(n));
             GEND;
             return;
 
@@ -1759,7 +4744,7 @@ static void dump_dot(struct rectx *ctx, struct node *n, FILE *f) {
         case OP_DOTSTAR:
         case OP_DOTPLUS:
             if (n->match) {
-                fprintf(f, "[SRCH NODE %d]", NODE_ID(ctx, n->match));
+                fprintf(f, "[SRCH NODE %d]", NODE_ID(ctx, MATCH_NODE(n)));
             } else {
                 fprintf(f, "none");
             }
@@ -1767,10 +4752,8 @@ static void dump_dot(struct rectx *ctx, struct node *n, FILE *f) {
             return;
 
         case OP_MATCHSET:
-            chars = __builtin_popcount(n->set->d[0]);
-            chars += __builtin_popcount(n->set->d[1]);
-            chars += __builtin_popcount(n->set->d[2]);
-            chars += __builtin_popcount(n->set->d[3]);
+            chars = 0;
+            for (int i=0; i < 8; i++) chars += __builtin_popcount(NODE_SET(n)->d[i]);
             fprintf(f, "%d chars", chars);
             GEND;
             return;
@@ -1815,23 +4798,954 @@ static void dump_dot(struct rectx *ctx, struct node *n, FILE *f) {
             GEND;
     }
 
-    if (n->a && (n->a != NOTUSED)) {
-        fprintf(f, "    n%p -> n%p [label=\"a\"];\n", (void*)n, (void*)n->a);
-        dump_dot(ctx, n->a, f);
+    if (n->a) {
+        fprintf(f, "    n%p -> n%p [label=\"a\"];\n", (void*)n, (void*)LEG_A(n));
+        dump_dot(ctx, LEG_A(n), f, hot);
     }
 
 bonly:
-    if (n->b && (n->b != NOTUSED)) {
-        fprintf(f, "    n%p -> n%p [label=\"b\"];\n", (void*)n, (void*)n->b);
-        dump_dot(ctx, n->b, f);
+    if (n->b && !EMPTY_GROUP(n)) {
+        fprintf(f, "    n%p -> n%p [label=\"b\"];\n", (void*)n, (void*)LEG_B(n));
+        dump_dot(ctx, LEG_B(n), f, hot);
     }
 }
 
 void rele_export_tree(struct rectx *ctx, const char *filename) {
     FILE *f = fopen(filename, "w");
+    uint32_t hot = 0;
+
+    if (!f) return;
+#ifdef RELE_HEATMAP
+    for (int i = 0; i < ctx->node_count; i++) {
+        if (ctx->state->heat[i].visits > hot) hot = ctx->state->heat[i].visits;
+    }
+#endif
     fprintf(f, "digraph tree {\n");
-    fprintf(stderr, "x\n");
-    dump_dot(ctx, ctx->root, f);
+    dump_dot(ctx, ctx->root, f, hot);
     fprintf(f, "}\n");
     fclose(f);
 }
+
+void rele_heatmap_clear(struct rectx *ctx) {
+#ifdef RELE_HEATMAP
+    memset(ctx->state->heat, 0, ctx->node_count * sizeof(struct heat));
+#else
+    (void)ctx;
+#endif
+}
+
+// -------------------------------------------------------------------------------
+// C CODE GENERATION
+// -------------------------------------------------------------------------------
+//
+// For patterns that are known at build time we can turn the tree into a
+// standalone C function, so a build only needs the generated code. The tree is
+// lowered into a simple program and each instruction becomes a case in one of
+// two switches, one that follows everything that doesn't consume a char and
+// one that checks the char for the rest. It runs the same way the task matcher
+// does, a list of threads in priority order with one per place at each char.
+//
+// Counters are unrolled and backreferences aren't supported.
+
+enum {
+    C_CHAR,             // ch
+    C_CLASS,            // one of the CLASS_xxx bits
+    C_SET,              // set
+    C_ANY,              // anything but 0 (for DOTSTAR/DOTPLUS)
+    C_MATCH,
+
+    // Don't consume anything...
+    C_SPLIT,            // x then y
+    C_JMP,              // x
+    C_SAVE,             // the position in slot x
+    C_ASSERT,           // ANCHOR ch
+    C_SETPOS,           // the position in slot x (start of a loop)
+    C_BACK,             // if nothing was matched since slot x then y
+};
+
+struct cinst {
+    uint8_t         op;
+    char            ch;
+    int             x;
+    int             y;
+    struct set      *set;
+};
+
+struct cgen {
+    struct rectx    *ctx;
+    struct cinst    *code;
+    int             size;           // how many we have space for
+    int             pc;             // the next one
+    int             slots;          // group start/end then loop positions
+};
+
+#define CG_MAX_CODE         0x7fff
+
+// Where a counter leaves goes in y until we know it, so it needs to be
+// something that isn't a real pc
+#define CG_PATCH(s)         (-1 - (s))
+
+static int cg_emit(struct cgen *g, uint8_t op, char ch, int x, int y) {
+    if (g->pc == g->size) {
+        if (g->size >= CG_MAX_CODE) return -1;
+        struct cinst *code = realloc(g->code, (g->size + 256) * sizeof(struct cinst));
+        if (!code) return -1;
+        g->code = code;
+        g->size += 256;
+    }
+    struct cinst *i = &g->code[g->pc];
+    i->op = op;
+    i->ch = ch;
+    i->x = x;
+    i->y = y;
+    i->set = NULL;
+    return g->pc++;
+}
+
+// Each iteration of a counter, leaving if it didn't match anything
+static int cg_node(struct cgen *g, struct node *n);
+
+static int cg_iteration(struct cgen *g, struct node *n, int s) {
+    if (!cg_node(g, LEG_B(n))) return 0;
+    return cg_emit(g, C_BACK, 0, s, CG_PATCH(s)) >= 0;
+}
+
+/**
+ * Lower the tree below n, returns 0 if we can't.
+ */
+static int cg_node(struct cgen *g, struct node *n) {
+    int icase = g->ctx->flags & RELE_CASELESS;
+    int s, l, split, back;
+
+    if (!n) return 1;
+
+    switch (n->op) {
+        case OP_CONCAT:
+            return cg_node(g, LEG_A(n)) && cg_node(g, LEG_B(n));
+
+        case OP_ALTERNATE:
+            if ((split = cg_emit(g, C_SPLIT, 0, g->pc + 1, 0)) < 0) return 0;
+            if (!cg_node(g, LEG_A(n))) return 0;
+            if ((l = cg_emit(g, C_JMP, 0, 0, 0)) < 0) return 0;
+            g->code[split].y = g->pc;
+            if (!cg_node(g, LEG_B(n))) return 0;
+            g->code[l].x = g->pc;
+            return 1;
+
+        case OP_GROUP:
+            if (n->group != NO_GROUP && cg_emit(g, C_SAVE, 0, n->group * 2, 0) < 0) return 0;
+            if (!EMPTY_GROUP(n) && !cg_node(g, LEG_B(n))) return 0;
+            if (n->group != NO_GROUP && cg_emit(g, C_SAVE, 0, n->group * 2 + 1, 0) < 0) return 0;
+            return 1;
+
+        case OP_MATCH:
+            if (n->ch1) return cg_emit(g, C_CHAR, n->ch1, 0, 0) >= 0;
+            return cg_emit(g, C_CLASS, n->cls, 0, 0) >= 0;
+
+        case OP_MATCHSTR:
+            for (int k = 0; k < n->len; k++) {
+                char ch = NODE_STR(n)[k];
+                if (cg_emit(g, C_CHAR, icase ? fast_tolower(ch) : ch, 0, 0) < 0) return 0;
+            }
+            return 1;
+
+        case OP_MATCHSET:
+            if ((l = cg_emit(g, C_SET, 0, 0, 0)) < 0) return 0;
+            g->code[l].set = NODE_SET(n);
+            return 1;
+
+        case OP_CRLF:
+            if (cg_emit(g, C_SPLIT, 0, g->pc + 1, g->pc + 2) < 0) return 0;
+            if (cg_emit(g, C_CHAR, 13, 0, 0) < 0) return 0;
+            return cg_emit(g, C_CHAR, 10, 0, 0) >= 0;
+
+        case OP_ANCHOR:
+            return cg_emit(g, C_ASSERT, n->ch1, 0, 0) >= 0;
+
+        case OP_DONE:
+            return cg_emit(g, C_MATCH, 0, 0, 0) >= 0;
+
+        case OP_QUESTION:
+            if ((split = cg_emit(g, C_SPLIT, 0, 0, 0)) < 0) return 0;
+            if (!cg_node(g, LEG_B(n))) return 0;
+            g->code[split].x = (n->lazy ? g->pc : split + 1);
+            g->code[split].y = (n->lazy ? split + 1 : g->pc);
+            return 1;
+
+        case OP_DOTSTAR:
+            if ((split = cg_emit(g, C_SPLIT, 0, 0, 0)) < 0) return 0;
+            if (cg_emit(g, C_ANY, 0, 0, 0) < 0) return 0;
+            if (cg_emit(g, C_JMP, 0, split, 0) < 0) return 0;
+            g->code[split].x = (n->lazy ? g->pc : split + 1);
+            g->code[split].y = (n->lazy ? split + 1 : g->pc);
+            return 1;
+
+        case OP_DOTPLUS:
+            if ((l = cg_emit(g, C_ANY, 0, 0, 0)) < 0) return 0;
+            if ((split = cg_emit(g, C_SPLIT, 0, 0, 0)) < 0) return 0;
+            g->code[split].x = (n->lazy ? g->pc : l);
+            g->code[split].y = (n->lazy ? l : g->pc);
+            return 1;
+
+        // Loops remember where each time around started, so an empty one
+        // leaves like it does in the task matcher
+        case OP_STAR:
+            s = g->slots++;
+            if (cg_emit(g, C_SETPOS, 0, s, 0) < 0) return 0;
+            if ((split = cg_emit(g, C_SPLIT, 0, 0, 0)) < 0) return 0;
+            if (!cg_node(g, LEG_B(n))) return 0;
+            if ((back = cg_emit(g, C_BACK, 0, s, 0)) < 0) return 0;
+            if (cg_emit(g, C_JMP, 0, split, 0) < 0) return 0;
+            g->code[back].y = g->pc;
+            g->code[split].x = (n->lazy ? g->pc : split + 1);
+            g->code[split].y = (n->lazy ? split + 1 : g->pc);
+            return 1;
+
+        case OP_PLUS:
+            s = g->slots++;
+            if (cg_emit(g, C_SETPOS, 0, s, 0) < 0) return 0;
+            l = g->pc;
+            if (!cg_node(g, LEG_B(n))) return 0;
+            if ((back = cg_emit(g, C_BACK, 0, s, 0)) < 0) return 0;
+            if ((split = cg_emit(g, C_SPLIT, 0, 0, 0)) < 0) return 0;
+            g->code[back].y = g->pc;
+            g->code[split].x = (n->lazy ? g->pc : l);
+            g->code[split].y = (n->lazy ? l : g->pc);
+            return 1;
+
+        // Counters are unrolled, min times and then either optional ones up
+        // to max or a loop if there isn't one. Only the optional ones leave
+        // when they don't match anything, an empty one still counts to min.
+        case OP_MULT: {
+            if (!n->max) return 1;
+            for (int i = 0; i < n->min; i++) {
+                if (!cg_node(g, LEG_B(n))) return 0;
+            }
+            if (n->max == n->min) return 1;
+            s = g->slots++;
+            int first = cg_emit(g, C_SETPOS, 0, s, 0);
+            if (first < 0) return 0;
+            if (n->max == NO_MAX) {
+                if ((split = cg_emit(g, C_SPLIT, 0, g->pc + 1, CG_PATCH(s))) < 0) return 0;
+                if (!cg_iteration(g, n, s)) return 0;
+                if (cg_emit(g, C_JMP, 0, split, 0) < 0) return 0;
+                if (n->lazy) { g->code[split].x = CG_PATCH(s); g->code[split].y = split + 1; }
+            } else {
+                for (int i = n->min; i < n->max; i++) {
+                    if ((split = cg_emit(g, C_SPLIT, 0, g->pc + 1, CG_PATCH(s))) < 0) return 0;
+                    if (n->lazy) { g->code[split].x = CG_PATCH(s); g->code[split].y = split + 1; }
+                    if (!cg_iteration(g, n, s)) return 0;
+                }
+            }
+            for (int i = first; i < g->pc; i++) {
+                if (g->code[i].op == C_SPLIT && g->code[i].x == CG_PATCH(s)) g->code[i].x = g->pc;
+                if ((g->code[i].op == C_SPLIT || g->code[i].op == C_BACK) && g->code[i].y == CG_PATCH(s)) g->code[i].y = g->pc;
+            }
+            return 1;
+        }
+    }
+    return 0;           // backreferences
+}
+
+// The test for a consuming instruction, on c
+static void cg_test(FILE *f, struct cgen *g, int pc) {
+    struct cinst *i = &g->code[pc];
+
+    switch (i->op) {
+        case C_CHAR:    fprintf(f, "c == 0x%02x", (unsigned char)i->ch); return;
+        case C_ANY:     fprintf(f, "c"); return;
+        case C_SET:
+            // Sets are named after the first instruction that used them
+            for (int k = 0; k <= pc; k++) {
+                if (g->code[k].op == C_SET && g->code[k].set == i->set) { fprintf(f, "IN(set_%d, c)", k); return; }
+            }
+            return;
+        case C_CLASS:
+            switch ((uint8_t)i->ch) {
+                case CLASS_ANY:     fprintf(f, "c"); return;
+                case CLASS_NOTNL:   fprintf(f, "c && c != '\\n'"); return;
+                case CLASS_DIGIT:   fprintf(f, "is_digit(c)"); return;
+                case CLASS_NDIGIT:  fprintf(f, "c && !is_digit(c)"); return;
+                case CLASS_WORD:    fprintf(f, "is_word(c)"); return;
+                case CLASS_NWORD:   fprintf(f, "c && !is_word(c)"); return;
+                case CLASS_SPACE:   fprintf(f, "is_space(c)"); return;
+                case CLASS_NSPACE:  fprintf(f, "c && !is_space(c)"); return;
+            }
+    }
+}
+
+static void cg_bitmap(FILE *f, const char *name, const uint32_t *d) {
+    fprintf(f, "static const uint32_t %s[8] = {\n   ", name);
+    for (int k = 0; k < 8; k++) fprintf(f, " 0x%08x,", d[k]);
+    fprintf(f, "\n};\n");
+}
+
+static void cg_write(FILE *f, struct cgen *g, const char *name) {
+    struct rectx *ctx = g->ctx;
+    int threads = 0, consumes = 0, jumps = 0;
+    char tname[32];
+
+    // Only include what gets used so the output builds without warnings
+    for (int pc = 0; pc < g->pc; pc++) {
+        if (g->code[pc].op <= C_MATCH) threads++;
+        if (g->code[pc].op < C_MATCH) consumes++;
+        if (g->code[pc].op == C_SPLIT || g->code[pc].op == C_JMP || g->code[pc].op >= C_ASSERT) jumps++;
+    }
+
+    fprintf(f, "/*\n");
+    fprintf(f, " * Generated by rele_export_c(), don't edit.\n");
+    fprintf(f, " *\n");
+    fprintf(f, " * int %s(const char *text, int len, int flags, struct rele_match_t *grp);\n", name);
+    fprintf(f, " *\n");
+    fprintf(f, " * Finds the same match as rele_match() with the pattern this came from, flags\n");
+    fprintf(f, " * can be RELE_ANCHORED or RELE_FULLMATCH, and if len is 0 the text is up to a\n");
+    fprintf(f, " * NUL. Returns 1 if it matched and fills in %s_groups groups if grp isn't NULL.\n", name);
+    fprintf(f, " */\n\n");
+    fprintf(f, "#include <stdint.h>\n");
+    fprintf(f, "#include <string.h>\n");
+    fprintf(f, "#include \"rele.h\"\n\n");
+
+    fprintf(f, "#define NPC         %d\n", g->pc);
+    fprintf(f, "#define NSLOTS      %d\n", g->slots);
+    fprintf(f, "#define NTHREADS    %d\n\n", threads);
+
+    fprintf(f, "const int %s_groups = %d;\n\n", name, ctx->groups);
+
+    fprintf(f, "struct thread { int pc; int32_t slot[NSLOTS]; };\n");
+    fprintf(f, "struct list { int n; struct thread t[NTHREADS]; };\n");
+    fprintf(f, "struct run { const char *text; const char *end; uint32_t gen; uint32_t mark[NPC]; };\n\n");
+
+    fprintf(f, "#define IN(set, c)  ((set[(c) >> 5] >> ((c) & 31)) & 1)\n");
+    fprintf(f, "#define MARK        do { if (r->mark[pc] == r->gen) return; r->mark[pc] = r->gen; } while (0)\n\n");
+
+    fprintf(f, "static inline int is_digit(unsigned c) { return c >= '0' && c <= '9'; }\n");
+    fprintf(f, "static inline int is_alnum(unsigned c) { return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'); }\n");
+    fprintf(f, "static inline int is_word(unsigned c) { return is_alnum(c) || c == '_'; }\n");
+    fprintf(f, "static inline int is_space(unsigned c) { return c == ' ' || (c >= 9 && c <= 13); }\n\n");
+
+    for (int pc = 0; pc < g->pc; pc++) {
+        if (g->code[pc].op != C_SET) continue;
+        int k;
+        for (k = 0; g->code[k].op != C_SET || g->code[k].set != g->code[pc].set; k++);
+        if (k != pc) continue;
+        snprintf(tname, sizeof(tname), "set_%d", pc);
+        cg_bitmap(f, tname, g->code[pc].set->d);
+    }
+    if (ctx->first_count > 1) {
+        uint32_t first[8] = { 0 };
+        for (int c = 0; c < 256; c++) {
+            uint8_t bits = (c < 128 ? ctx->first.lo[c & 15] : ctx->first.hi[c & 15]);
+            if (bits & (1 << ((c >> 4) & 7))) first[c >> 5] |= (1u << (c & 31));
+        }
+        cg_bitmap(f, "first", first);
+    }
+
+    // The task matcher's word boundary, a word char is anything \w matches
+    fprintf(f, "\nstatic inline int boundary(struct run *r, const char *p) {\n");
+    fprintf(f, "    if (p == r->text) return p < r->end && is_word((unsigned char)*p);\n");
+    fprintf(f, "    if (p == r->end) return is_word((unsigned char)p[-1]);\n");
+    fprintf(f, "    return is_word((unsigned char)p[-1]) ^ is_word((unsigned char)*p);\n");
+    fprintf(f, "}\n");
+
+    // Everything that doesn't consume a char
+    fprintf(f, "\nstatic void add(struct run *r, struct list *l, int pc, const char *p, int32_t *slot) {\n");
+    fprintf(f, "    int32_t pos = p - r->text;\n");
+    fprintf(f, "    int32_t save;\n\n");
+    if (jumps) fprintf(f, "again:\n");
+    fprintf(f, "    switch (pc) {\n");
+    for (int pc = 0; pc < g->pc; pc++) {
+        struct cinst *i = &g->code[pc];
+
+        switch (i->op) {
+            case C_SPLIT:
+                fprintf(f, "    case %d: add(r, l, %d, p, slot); pc = %d; goto again;\n", pc, i->x, i->y);
+                break;
+            case C_JMP:
+                fprintf(f, "    case %d: pc = %d; goto again;\n", pc, i->x);
+                break;
+            case C_SAVE:
+            case C_SETPOS:
+                fprintf(f, "    case %d: save = slot[%d]; slot[%d] = pos; add(r, l, %d, p, slot); slot[%d] = save; return;\n",
+                                                                                    pc, i->x, i->x, pc + 1, i->x);
+                break;
+            case C_BACK:
+                fprintf(f, "    case %d: if (slot[%d] == pos) { pc = %d; goto again; }\n", pc, i->x, i->y);
+                fprintf(f, "             save = slot[%d]; slot[%d] = pos; add(r, l, %d, p, slot); slot[%d] = save; return;\n",
+                                                                                    i->x, i->x, pc + 1, i->x);
+                break;
+            case C_ASSERT:
+                fprintf(f, "    case %d: if (", pc);
+                switch (i->ch) {
+                    case 'A':   fprintf(f, "p == r->text"); break;
+                    case 'Z':   fprintf(f, "p == r->end"); break;
+                    case '^':   fprintf(f, "p == r->text || p[-1] == '\\n'"); break;
+                    case '$':   fprintf(f, "p == r->end || *p == '\\n'"); break;
+                    case 'b':   fprintf(f, "boundary(r, p)"); break;
+                    case 'B':   fprintf(f, "!boundary(r, p)"); break;
+                    default:    fprintf(f, "0"); break;
+                }
+                fprintf(f, ") { pc = %d; goto again; } return;\n", pc + 1);
+                break;
+        }
+    }
+    fprintf(f, "    default: MARK;\n");
+    fprintf(f, "        l->t[l->n].pc = pc;\n");
+    fprintf(f, "        memcpy(l->t[l->n].slot, slot, sizeof(l->t[0].slot));\n");
+    fprintf(f, "        l->n++;\n");
+    fprintf(f, "        return;\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "}\n\n");
+
+    // And the main loop
+    fprintf(f, "int %s(const char *text, int len, int flags, struct rele_match_t *grp) {\n", name);
+    fprintf(f, "    struct run r;\n");
+    fprintf(f, "    struct list a, b, *clist = &a, *nlist = &b, *x;\n");
+    fprintf(f, "    int32_t slot[NSLOTS];\n");
+    fprintf(f, "    int32_t best[%d];\n", ctx->groups * 2);
+    fprintf(f, "    const char *p = text;\n");
+    fprintf(f, "    int anchored = %s(flags & (RELE_ANCHORED | RELE_FULLMATCH));\n", ctx->anchored ? "1 || " : "");
+    fprintf(f, "    int full = flags & RELE_FULLMATCH;\n");
+    fprintf(f, "    int matched = 0;\n\n");
+    fprintf(f, "    r.text = text;\n");
+    fprintf(f, "    r.end = text + (len ? len : (int)strlen(text));\n");
+    fprintf(f, "    r.gen = 1;\n");
+    fprintf(f, "    memset(r.mark, 0, sizeof(r.mark));\n");
+    fprintf(f, "    a.n = 0;\n\n");
+    fprintf(f, "    while (1) {\n");
+    fprintf(f, "        // A new start goes after everything else\n");
+    fprintf(f, "        if (!matched && (p == text || !anchored)) {\n");
+    if (ctx->first_count) {
+        fprintf(f, "            if (!clist->n && !anchored) {\n");
+        if (ctx->first_count == 1) {
+            fprintf(f, "                p = memchr(p, 0x%02x, r.end - p);\n", (unsigned char)ctx->first_ch);
+            fprintf(f, "                if (!p) break;\n");
+        } else {
+            fprintf(f, "                while (p < r.end && !IN(first, (unsigned char)*p)) p++;\n");
+            fprintf(f, "                if (p == r.end) break;\n");
+        }
+        fprintf(f, "                r.gen++;\n");
+        fprintf(f, "            }\n");
+    }
+    fprintf(f, "            for (int i = 0; i < NSLOTS; i++) slot[i] = -1;\n");
+    fprintf(f, "            add(&r, clist, 0, p, slot);\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "        if (!clist->n) {\n");
+    fprintf(f, "            if (matched || anchored || p == r.end) break;\n");
+    fprintf(f, "            p++;\n");
+    fprintf(f, "            r.gen++;\n");
+    fprintf(f, "            continue;\n");
+    fprintf(f, "        }\n\n");
+    if (consumes) fprintf(f, "        unsigned c = (p < r.end ? (unsigned char)*p : 0);\n");
+    if (consumes && ctx->flags & RELE_CASELESS) fprintf(f, "        if (c >= 'A' && c <= 'Z') c += 32;\n");
+    fprintf(f, "        r.gen++;\n");
+    fprintf(f, "        nlist->n = 0;\n");
+    fprintf(f, "        for (int i = 0; i < clist->n; i++) {\n");
+    fprintf(f, "            struct thread *t = &clist->t[i];\n\n");
+    fprintf(f, "            switch (t->pc) {\n");
+    for (int pc = 0; pc < g->pc; pc++) {
+        struct cinst *i = &g->code[pc];
+
+        if (i->op == C_MATCH) {
+            fprintf(f, "            case %d:\n", pc);
+            fprintf(f, "                if (full && p != r.end) break;\n");
+            fprintf(f, "                memcpy(best, t->slot, sizeof(best));\n");
+            fprintf(f, "                matched = 1;\n");
+            fprintf(f, "                i = clist->n;       // nothing after us can win\n");
+            fprintf(f, "                break;\n");
+        } else if (i->op < C_MATCH) {
+            fprintf(f, "            case %d: if (p < r.end && (", pc);
+            cg_test(f, g, pc);
+            fprintf(f, ")) add(&r, nlist, %d, p + 1, t->slot); break;\n", pc + 1);
+        }
+    }
+    fprintf(f, "            }\n");
+    fprintf(f, "        }\n");
+    fprintf(f, "        x = clist; clist = nlist; nlist = x;\n");
+    fprintf(f, "        if (p++ == r.end) break;\n");
+    fprintf(f, "    }\n\n");
+    fprintf(f, "    if (!matched) return 0;\n");
+    fprintf(f, "    for (int i = 0; grp && i < %d; i++) {\n", ctx->groups);
+    fprintf(f, "        grp[i].rm_so = best[i * 2];\n");
+    fprintf(f, "        grp[i].rm_eo = best[i * 2 + 1];\n");
+    fprintf(f, "    }\n");
+    fprintf(f, "    return 1;\n");
+    fprintf(f, "}\n");
+}
+
+/**
+ * Write a standalone C function called name that matches the same thing as
+ * ctx to filename, returns 0 if the pattern has something we can't generate
+ * (backreferences or a set) or the file can't be written.
+ */
+int rele_export_c(struct rectx *ctx, const char *filename, const char *name) {
+    struct cgen g = { .ctx = ctx, .slots = ctx->groups * 2 };
+    int rc = 0;
+
+    if (ctx->set_count || ctx->has & HAS_BACKREF) return 0;
+    if (!cg_node(&g, ctx->root)) goto done;
+
+    FILE *f = fopen(filename, "w");
+    if (!f) goto done;
+    cg_write(f, &g, name);
+    rc = (fclose(f) == 0);
+
+done:
+    free(g.code);
+    return rc;
+}
+
+
+// -------------------------------------------------------------------------------
+// JIT
+// -------------------------------------------------------------------------------
+//
+// With RELE_NATIVE the program from the code generator above is turned into
+// x86-64 code in an executable page rather than C source. It runs the same thread
+// lists as the generated C, so the groups come out the same as the task matcher,
+// but each step is a few native instructions rather than a walk around the tree.
+// Anything the code generator can't do, or anything other than x86-64 Linux,
+// just uses the task matcher.
+//
+// Each pc that doesn't consume a char is a block that is called with the
+// position in r15 (and as an offset in r14d) and the thread's slots at r13, it
+// calls or jumps to the blocks after it. A consuming pc has a block that tests
+// the char in ebp and jumps to the next one, and one that adds the thread to the
+// list at r12 with jit_push(). The run state is in rbx.
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+
+struct jit_run;
+struct jit_list;
+
+struct jit {
+    uint8_t         *code;          // mmap'd, only executable once it's written
+    size_t          size;
+    void            (*run)(struct jit_run *r, struct jit_list *l, int32_t *slot, char *p, uint8_t *block, int c);
+    uint8_t         **add;          // per pc, the block that adds it to a list
+    uint8_t         **step;         // per consuming pc, the block that tests c
+    int             npc;
+    int             slots;          // group start/end then loop positions
+    int             threads;        // most a list can hold
+    int             match;          // the pc of the match
+};
+
+struct jit_list {
+    int             n;
+    int32_t         t[];            // the pc then the slots for each thread
+};
+
+// The native code uses start and end, so they need to stay first
+struct jit_run {
+    char            *start;
+    char            *end;
+    uint32_t        gen;            // bumped for each list we build
+    int             slots;
+    uint32_t        *mark;          // gen when each pc was last added
+    struct jit_list *list[2];
+    int32_t         *slot;          // for a new start
+};
+
+// No block comes close to this
+#define JIT_MAX_BLOCK       96
+
+struct jgen {
+    uint8_t         *buf;
+    int             len;
+    int             *fix;           // where a rel32 goes...
+    int             *to;            // ...and the pc whose add block it's for
+    int             nfix;
+};
+
+#define JIT_BYTES(g, s)     jit_bytes(g, s, sizeof(s) - 1)
+
+static void jit_bytes(struct jgen *g, const char *s, int n) {
+    memcpy(g->buf + g->len, s, n);
+    g->len += n;
+}
+static void jit_u32(struct jgen *g, uint32_t v) {
+    memcpy(g->buf + g->len, &v, 4);
+    g->len += 4;
+}
+static void jit_u64(struct jgen *g, uint64_t v) {
+    memcpy(g->buf + g->len, &v, 8);
+    g->len += 8;
+}
+
+// A rel32 to the add block for pc, filled in once we know where it is
+static void jit_to(struct jgen *g, int pc) {
+    g->fix[g->nfix] = g->len;
+    g->to[g->nfix++] = pc;
+    jit_u32(g, 0);
+}
+
+// A rel32 to somewhere we've already been
+static void jit_back(struct jgen *g, int off) {
+    jit_u32(g, off - (g->len + 4));
+}
+
+// Called (well, jumped to) by the add block of a consuming pc or the match
+static void jit_push(struct jit_run *r, struct jit_list *l, int pc, int32_t *slot) {
+    if (r->mark[pc] == r->gen) return;
+    r->mark[pc] = r->gen;
+
+    int32_t *t = l->t + l->n++ * (1 + r->slots);
+    t[0] = pc;
+    memcpy(t + 1, slot, r->slots * sizeof(int32_t));
+}
+
+// Exactly the same as \b in the task matcher
+static int jit_boundary(struct jit_run *r, char *p) {
+    if (p == r->start) return is_word(*p);
+    if (p == r->end) return is_word(p[-1]);
+    return is_word(p[-1]) != is_word(*p);
+}
+
+// Remember the slot, set it to the position and carry on, then put it back
+static void jit_save(struct jgen *g, int x, int next) {
+    JIT_BYTES(g, "\x41\x8b\x85"); jit_u32(g, x * 4);           // mov eax, [r13 + x*4]
+    JIT_BYTES(g, "\x50");                                       // push rax
+    JIT_BYTES(g, "\x45\x89\xb5"); jit_u32(g, x * 4);           // mov [r13 + x*4], r14d
+    JIT_BYTES(g, "\xe8"); jit_to(g, next);                      // call next
+    JIT_BYTES(g, "\x58");                                       // pop rax
+    JIT_BYTES(g, "\x41\x89\x85"); jit_u32(g, x * 4);           // mov [r13 + x*4], eax
+    JIT_BYTES(g, "\xc3");                                       // ret
+}
+
+// Everything that doesn't consume a char, fail is a ret
+static void jit_add_block(struct jgen *g, struct cinst *i, int pc, int fail) {
+    switch (i->op) {
+        case C_SPLIT:
+            JIT_BYTES(g, "\x48\x83\xec\x08");                   // sub rsp, 8
+            JIT_BYTES(g, "\xe8"); jit_to(g, i->x);              // call x
+            JIT_BYTES(g, "\x48\x83\xc4\x08");                   // add rsp, 8
+            JIT_BYTES(g, "\xe9"); jit_to(g, i->y);              // jmp y
+            return;
+
+        case C_JMP:
+            JIT_BYTES(g, "\xe9"); jit_to(g, i->x);              // jmp x
+            return;
+
+        case C_SAVE:
+        case C_SETPOS:
+            jit_save(g, i->x, pc + 1);
+            return;
+
+        case C_BACK:
+            JIT_BYTES(g, "\x45\x39\xb5"); jit_u32(g, i->x * 4); // cmp [r13 + x*4], r14d
+            JIT_BYTES(g, "\x0f\x84"); jit_to(g, i->y);          // je y
+            jit_save(g, i->x, pc + 1);
+            return;
+
+        case C_ASSERT:
+            switch (i->ch) {
+                case 'A':
+                case '^':
+                    JIT_BYTES(g, "\x4c\x3b\x7b\x00");           // cmp r15, [rbx + start]
+                    if (i->ch == 'A') break;
+                    JIT_BYTES(g, "\x0f\x84"); jit_to(g, pc + 1);// je next
+                    JIT_BYTES(g, "\x41\x80\x7f\xff\x0a");       // cmp byte [r15 - 1], '\n'
+                    break;
+                case 'Z':
+                case '$':
+                    JIT_BYTES(g, "\x4c\x3b\x7b\x08");           // cmp r15, [rbx + end]
+                    if (i->ch == 'Z') break;
+                    JIT_BYTES(g, "\x0f\x84"); jit_to(g, pc + 1);// je next
+                    JIT_BYTES(g, "\x41\x80\x3f\x0a");           // cmp byte [r15], '\n'
+                    break;
+                case 'b':
+                case 'B':
+                    JIT_BYTES(g, "\x48\x83\xec\x08");           // sub rsp, 8
+                    JIT_BYTES(g, "\x48\x89\xdf");               // mov rdi, rbx
+                    JIT_BYTES(g, "\x4c\x89\xfe");               // mov rsi, r15
+                    JIT_BYTES(g, "\x48\xb8"); jit_u64(g, (uintptr_t)jit_boundary);
+                    JIT_BYTES(g, "\xff\xd0");                   // call rax
+                    JIT_BYTES(g, "\x48\x83\xc4\x08");           // add rsp, 8
+                    JIT_BYTES(g, "\x83\xf8\x01");               // cmp eax, 1 (so ne means no boundary)
+                    if (i->ch == 'B') {
+                        JIT_BYTES(g, "\x0f\x84"); jit_back(g, fail);    // je fail
+                        JIT_BYTES(g, "\xe9"); jit_to(g, pc + 1);        // jmp next
+                        return;
+                    }
+                    break;
+                default:
+                    JIT_BYTES(g, "\xc3");                       // ret
+                    return;
+            }
+            JIT_BYTES(g, "\x0f\x85"); jit_back(g, fail);        // jne fail
+            JIT_BYTES(g, "\xe9"); jit_to(g, pc + 1);            // jmp next
+            return;
+    }
+
+    // A consuming pc (or the match) waits in the list
+    JIT_BYTES(g, "\x48\x89\xdf");                               // mov rdi, rbx
+    JIT_BYTES(g, "\x4c\x89\xe6");                               // mov rsi, r12
+    JIT_BYTES(g, "\xba"); jit_u32(g, pc);                       // mov edx, pc
+    JIT_BYTES(g, "\x4c\x89\xe9");                               // mov rcx, r13
+    JIT_BYTES(g, "\x48\xb8"); jit_u64(g, (uintptr_t)jit_push);  // mov rax, jit_push
+    JIT_BYTES(g, "\xff\xe0");                                   // jmp rax
+}
+
+// The test for a consuming pc, on the char in ebp
+static void jit_step_block(struct jgen *g, struct cinst *i, int pc, int fail) {
+    switch (i->op) {
+        case C_CHAR:
+            JIT_BYTES(g, "\x81\xfd"); jit_u32(g, (uint8_t)i->ch);   // cmp ebp, ch
+            break;
+        case C_ANY:
+            JIT_BYTES(g, "\x85\xed");                               // test ebp, ebp
+            break;
+        case C_CLASS:
+            JIT_BYTES(g, "\x85\xed");                               // test ebp, ebp
+            JIT_BYTES(g, "\x0f\x84"); jit_back(g, fail);            // je fail
+            JIT_BYTES(g, "\x48\xb8"); jit_u64(g, (uintptr_t)class_table);
+            JIT_BYTES(g, "\x0f\xb6\x04\x28");                       // movzx eax, byte [rax + rbp]
+            JIT_BYTES(g, "\xa8"); jit_bytes(g, &i->ch, 1);          // test al, cls
+            break;
+        case C_SET:
+            JIT_BYTES(g, "\x48\xb8"); jit_u64(g, (uintptr_t)i->set->d);
+            JIT_BYTES(g, "\x0f\xa3\x28");                           // bt [rax], ebp
+            JIT_BYTES(g, "\x0f\x83"); jit_back(g, fail);            // jnc fail
+            JIT_BYTES(g, "\xe9"); jit_to(g, pc + 1);                // jmp next
+            return;
+    }
+    // C_CHAR wants equal, the others non-zero
+    if (i->op == C_CHAR) JIT_BYTES(g, "\x0f\x85");                  // jne fail
+    else JIT_BYTES(g, "\x0f\x84");                                  // je fail
+    jit_back(g, fail);
+    JIT_BYTES(g, "\xe9"); jit_to(g, pc + 1);                        // jmp next
+}
+
+/**
+ * Lower ctx and build the native code for it, NULL if we can't.
+ */
+static struct jit *jit_build(struct rectx *ctx) {
+    struct cgen cg = { .ctx = ctx, .slots = ctx->groups * 2 };
+    struct jgen g = { 0 };
+    struct jit *j = NULL;
+    int fail;
+
+    if (ctx->set_count || ctx->has & HAS_BACKREF) return NULL;
+    if (!cg_node(&cg, ctx->root)) goto done;
+
+    j = calloc(1, sizeof(struct jit) + 2 * cg.pc * sizeof(uint8_t *));
+    g.fix = malloc(8 * cg.pc * sizeof(int));
+    if (!j || !g.fix) goto fail;
+    g.to = g.fix + 4 * cg.pc;
+
+    j->add = (uint8_t **)(j + 1);
+    j->step = j->add + cg.pc;
+    j->npc = cg.pc;
+    j->slots = cg.slots;
+    for (int pc = 0; pc < cg.pc; pc++) {
+        if (cg.code[pc].op <= C_MATCH) j->threads++;
+        if (cg.code[pc].op == C_MATCH) j->match = pc;
+    }
+
+    j->size = (cg.pc * JIT_MAX_BLOCK + 64 + 4095) & ~(size_t)4095;
+    j->code = mmap(NULL, j->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED) { j->code = NULL; goto fail; }
+    g.buf = j->code;
+
+    // The way in from C, run(r, l, slot, p, block, c) calls block with everything
+    // where the blocks want it...
+    JIT_BYTES(&g, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57");     // push rbx, rbp, r12-r15
+    JIT_BYTES(&g, "\x48\x89\xfb");                                  // mov rbx, rdi
+    JIT_BYTES(&g, "\x49\x89\xf4");                                  // mov r12, rsi
+    JIT_BYTES(&g, "\x49\x89\xd5");                                  // mov r13, rdx
+    JIT_BYTES(&g, "\x49\x89\xcf");                                  // mov r15, rcx
+    JIT_BYTES(&g, "\x49\x89\xce");                                  // mov r14, rcx
+    JIT_BYTES(&g, "\x4c\x2b\x33");                                  // sub r14, [rbx + start]
+    JIT_BYTES(&g, "\x44\x89\xcd");                                  // mov ebp, r9d
+    JIT_BYTES(&g, "\x48\x83\xec\x08");                              // sub rsp, 8
+    JIT_BYTES(&g, "\x41\xff\xd0");                                  // call r8
+    JIT_BYTES(&g, "\x48\x83\xc4\x08");                              // add rsp, 8
+    JIT_BYTES(&g, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5d\x5b");     // pop them again
+    fail = g.len;
+    JIT_BYTES(&g, "\xc3");                                          // ret (and where a failed test goes)
+
+    for (int pc = 0; pc < cg.pc; pc++) {
+        j->add[pc] = g.buf + g.len;
+        jit_add_block(&g, &cg.code[pc], pc, fail);
+        if (cg.code[pc].op < C_MATCH) {
+            j->step[pc] = g.buf + g.len;
+            jit_step_block(&g, &cg.code[pc], pc, fail);
+        }
+    }
+
+    for (int k = 0; k < g.nfix; k++) {
+        if (g.to[k] < 0 || g.to[k] >= cg.pc) goto fail;
+        int32_t rel = j->add[g.to[k]] - (g.buf + g.fix[k] + 4);
+        memcpy(g.buf + g.fix[k], &rel, 4);
+    }
+
+    if (mprotect(j->code, j->size, PROT_READ | PROT_EXEC) != 0) goto fail;
+    j->run = (void *)j->code;
+    goto done;
+
+fail:
+    jit_free(j);
+    j = NULL;
+done:
+    free(g.fix);
+    free(cg.code);
+    return j;
+}
+
+static void jit_free(struct jit *j) {
+    if (!j) return;
+    if (j->code) munmap(j->code, j->size);
+    free(j);
+}
+
+#define JIT_LIST_SIZE(j)    (sizeof(struct jit_list) + (j)->threads * (1 + (j)->slots) * sizeof(int32_t))
+#define JIT_RUN_SIZE(j)     (sizeof(struct jit_run) + (j)->npc * sizeof(uint32_t) + 2 * JIT_LIST_SIZE(j) + \
+                                                                            (j)->slots * sizeof(int32_t))
+
+static struct jit_run *jit_run_new(struct rematch *m) {
+    struct jit *j = m->ctx->jit;
+    int lsize = JIT_LIST_SIZE(j);
+    struct jit_run *r = malloc(JIT_RUN_SIZE(j));
+    if (!r) return NULL;
+
+    r->gen = 0;
+    r->slots = j->slots;
+    r->mark = (uint32_t *)(r + 1);
+    memset(r->mark, 0, j->npc * sizeof(uint32_t));
+    r->list[0] = (struct jit_list *)(r->mark + j->npc);
+    r->list[1] = (struct jit_list *)((char *)r->list[0] + lsize);
+    r->slot = (int32_t *)((char *)r->list[1] + lsize);
+    m->jit_run = r;
+    return r;
+}
+
+static uint32_t jit_held(struct rematch *m) {
+    return (m->jit_run ? JIT_RUN_SIZE(m->ctx->jit) : 0);
+}
+
+static uint32_t jit_code_size(struct jit *j) {
+    return (j ? j->size : 0);
+}
+
+// A new generation means nothing has been added to the list we are building
+static inline void jit_gen(struct jit_run *r, int npc) {
+    if (!++r->gen) { memset(r->mark, 0, npc * sizeof(uint32_t)); r->gen = 1; }
+}
+
+/**
+ * The native version of rele_match_iter(), starting in the same places. Returns
+ * -1 if we couldn't get the memory so the task matcher can have a go.
+ */
+static int jit_exec(struct rematch *m, char *start, char *p, char *end, int flags) {
+    struct rectx *ctx = m->ctx;
+    struct jit *j = ctx->jit;
+    struct jit_run *r = (m->jit_run ? m->jit_run : jit_run_new(m));
+    if (!r) return JIT_NOMEM;
+
+    struct jit_list *clist = r->list[0], *nlist = r->list[1], *x;
+    struct node *fs = ctx->fast_start;
+    int icase = ctx->flags & RELE_CASELESS;
+    int full = HAS_FLAG(flags, RELE_FULLMATCH);
+    int once = (fs && (fs->op == OP_DOTSTAR || fs->op == OP_DOTPLUS));
+    int seed = 1;
+    char *cand = p;
+    uint32_t limit = (HAS_FLAG(flags, RELE_YIELD) ? 0 : m->limit);
+    uint32_t slice = (HAS_FLAG(flags, RELE_YIELD) ? m->limit : 0);
+    uint32_t steps = 0;
+
+    if (m->resume.active) {
+        // Carry on from where we yielded, the lists are as we left them
+        cand = m->resume.cand;
+        seed = m->resume.seed;
+        once = m->resume.once;
+        m->resume.active = 0;
+    } else {
+        if (ctx->anchored || HAS_FLAG(flags, RELE_ANCHORED | RELE_FULLMATCH)) once = 1;
+        if (!once) {
+            cand = next_start(m, fs, start, p, end, icase);
+            if (!cand) return 0;
+        }
+        r->start = start;
+        r->end = end;
+        clist->n = 0;
+    }
+
+    while (1) {
+        // Out of steps for now, the current list is kept as list[0]
+        if (slice && steps >= slice) {
+            r->list[0] = clist;
+            r->list[1] = nlist;
+            m->resume = (struct resume){ .start = start, .p = p, .end = end, .cand = cand, .flags = flags,
+                                         .seed = seed, .once = once, .jit = 1, .active = 1 };
+            return RELE_ME_INPROGRESS;
+        }
+
+        // If we have nothing running then skip straight to the next start point
+        if (!clist->n) {
+            if (!seed) break;
+            p = cand;
+            jit_gen(r, j->npc);
+        }
+
+        // A new start goes after everything else
+        if (seed && p == cand) {
+            STAT_ADD(m, starts, 1);
+            for (int i = 0; i < j->slots; i++) r->slot[i] = -1;
+            j->run(r, clist, r->slot, p, j->add[0], 0);
+
+            if (once) {
+                seed = 0;
+            } else {
+                cand = (p < end) ? next_start(m, fs, start, p + 1, end, icase) : NULL;
+                if (!cand) seed = 0;
+            }
+        }
+
+        int c = (p < end ? (icase ? fast_tolower(*p) : (unsigned char)*p) : 0);
+        int32_t *t = clist->t;
+
+        // Each thread moving on is a step
+        steps += clist->n;
+        STAT_ADD(m, steps, clist->n);
+        STAT_MAX(m, peak, clist->n);
+        if (limit && steps > limit) {
+            if (m->done) { task_release(m, m->done); m->done = NULL; }
+            return RELE_ME_LIMIT;
+        }
+
+        jit_gen(r, j->npc);
+        nlist->n = 0;
+        for (int i = 0; i < clist->n; i++, t += 1 + j->slots) {
+            if (t[0] == j->match) {
+                if (full && p != end) continue;
+                if (!m->done && !(m->done = task_new(m, NULL, NULL, NULL, NULL))) return JIT_NOMEM;
+                memcpy(m->done->grp, t + 1, ctx->groups * sizeof(struct rele_match_t));
+                seed = 0;
+                break;          // nothing after us can win
+            }
+            if (p < end) j->run(r, nlist, t + 1, p + 1, j->step[t[0]], c);
+        }
+        x = clist; clist = nlist; nlist = x;
+        if (p++ == end) break;
+    }
+    return (m->done != NULL);
+}
+
+#else
+
+static struct jit *jit_build(struct rectx *ctx) {
+    return NULL;
+}
+static void jit_free(struct jit *j) {
+}
+static int jit_exec(struct rematch *m, char *start, char *p, char *end, int flags) {
+    return JIT_NOMEM;
+}
+static uint32_t jit_held(struct rematch *m) {
+    return 0;
+}
+static uint32_t jit_code_size(struct jit *j) {
+    return 0;
+}
+
+#endif
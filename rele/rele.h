@@ -8,9 +8,16 @@
 #define RELE_CASELESS          (1 << 0)            // caseless matching
 #define RELE_NEWLINE           (1 << 1)            // multiline matching
 #define RELE_NO_FASTSTART      (1 << 2)            // disable FASTSTART optimisation
+#define RELE_NO_DFA            (1 << 3)            // always use the task matcher
+#define RELE_STREAM            (1 << 4)            // for rele_stream_xxx(), nothing that looks ahead
+#define RELE_NATIVE            (1 << 5)            // native code for the matcher (x86-64 Linux only)
 
 // Match flags...
-#define RELE_KEEP_TASKS        (1 << 16)
+#define RELE_KEEP_TASKS        (1 << 16)           // no effect, tasks always come from the state
+#define RELE_NOSUB             (1 << 17)           // only the return code is needed, no groups
+#define RELE_ANCHORED          (1 << 18)           // only match at the start of the text
+#define RELE_FULLMATCH         (1 << 19)           // only match the whole of the text
+#define RELE_YIELD             (1 << 20)           // stop at the step limit and carry on later
 
 // Error codes for compile...
 enum {
@@ -24,30 +31,132 @@ enum {
     RELE_CE_QUOTE = -7,         // error in quoted string
     RELE_CE_TRAILBS = -8,       // trailing backslash
     RELE_CE_HEX = -9,           // invalid hex
+    RELE_CE_STREAM = -10,       // can't be used with RELE_STREAM
+    RELE_CE_SET = -11,          // bad count, or can't be used in a set
+    RELE_CE_TOOBIG = -12,       // too many nodes
+    RELE_CE_BLOB = -13,         // not a blob we can load
 };
 
 // Error codes for match...
 enum {
     RELE_ME_OK = 0,
+    RELE_ME_LIMIT = -1,         // gave up, see rele_match_limit() (or out of tasks)
+    RELE_ME_INPROGRESS = -2,    // stopped with RELE_YIELD, see rele_match_resume()
 };
 
 // A define for this, but it will be anonymous
 struct rectx;
 
+// Per-thread match state, also anonymous. A compiled rectx is read-only once
+// rele_compile() returns, so it can be shared between threads as long as
+// each thread matches using its own state.
+struct rematch;
+
 // A type used for matching groups... 
 struct rele_match_t {
     int32_t     rm_so;
     int32_t     rm_eo;
 };
 
+// Called for each match by rele_match_all(), return non-zero to stop
+typedef int (*rele_callback)(void *arg, struct rele_match_t *groups, int count);
+
 struct rectx *rele_compile(char *regex, uint32_t flags, int *error);
 int rele_match(struct rectx *ctx, char *p, int len, int flags);
+int rele_match_from(struct rectx *ctx, char *p, int len, int offset, int flags);
+int rele_match_all(struct rectx *ctx, char *p, int len, int flags, rele_callback fn, void *arg);
 void rele_free(struct rectx *ctx);
 
 int rele_match_count(struct rectx *ctx);
 struct rele_match_t *rele_get_match(struct rectx *ctx, int n);
 struct rele_match_t *rele_get_matches(struct rectx *ctx);
 
+// Matching with an explicit state (rele_match() uses one built into the ctx)
+struct rematch *rele_state_new(struct rectx *ctx);
+void rele_state_free(struct rematch *m);
+int rele_exec(struct rematch *m, char *p, int len, int flags);
+int rele_exec_from(struct rematch *m, char *p, int len, int offset, int flags);
+int rele_exec_all(struct rematch *m, char *p, int len, int flags, rele_callback fn, void *arg);
+struct rele_match_t *rele_state_match(struct rematch *m, int n);
+struct rele_match_t *rele_state_matches(struct rematch *m);
+
+// A cap on the work a single match can do, past it the match gives up and
+// returns RELE_ME_LIMIT (0, the default, means no limit). Matching never
+// allocates, a match that needs more live tasks than the state was sized for
+// (only big counters or backreferences can) gives RELE_ME_LIMIT as well.
+void rele_match_limit(struct rectx *ctx, uint32_t steps);
+void rele_state_limit(struct rematch *m, uint32_t steps);
+
+// With RELE_YIELD a match that reaches the limit returns RELE_ME_INPROGRESS
+// instead, and these carry it on for the same number of steps again
+int rele_match_resume(struct rectx *ctx);
+int rele_exec_resume(struct rematch *m);
+
+// What the last match did, if rele.c was built with RELE_STATS (otherwise
+// these are zero), and what the compiled regex uses (always filled in)
+struct rele_stats {
+    uint32_t    steps;          // nodes the task matcher visited (or JIT thread steps)
+    uint32_t    tasks;          // tasks created
+    uint32_t    recycled;       // tasks given back to the free list
+    uint32_t    peak;           // most tasks (or JIT threads) alive at once
+    uint32_t    dedupes;        // tasks dropped because another got there first
+    uint32_t    starts;         // places a match was started from
+    uint32_t    skipped;        // bytes the start prefilters skipped over
+
+    uint32_t    held;           // heap bytes the state is holding now (RELE_NATIVE)
+    uint32_t    nodes;
+    uint32_t    node_bytes;
+    uint32_t    set_bytes;
+    uint32_t    string_bytes;   // including the search tables
+    uint32_t    state_bytes;    // a match state, with its task slab and DFA cache
+    uint32_t    size;           // the whole ctx block
+};
+
+int rele_get_stats(struct rectx *ctx, struct rele_stats *stats);
+int rele_state_stats(struct rematch *m, struct rele_stats *stats);
+
+// Pattern sets, many regexes matched in one pass with a bit in hits for
+// each one that matched
+#define RELE_SET_WORDS(count)   (((count) + 31) / 32)
+
+struct rectx *rele_compile_set(char **regex, int count, uint32_t flags, int *error);
+int rele_match_set(struct rectx *ctx, char *p, int len, int flags, uint32_t *hits, struct rele_match_t *earliest);
+int rele_exec_set(struct rematch *m, char *p, int len, int flags, uint32_t *hits, struct rele_match_t *earliest);
+
+// Matching against data that arrives in chunks (needs RELE_STREAM), offsets
+// are from the start of the stream.
+int rele_stream_begin(struct rematch *m, int flags);
+int rele_stream_feed(struct rematch *m, char *p, int len);
+int rele_stream_end(struct rematch *m);
+int32_t rele_stream_keep(struct rematch *m);
+
+// Saving a compiled regex so it can be matched in place later (from flash or
+// an mmap), the blob has to stay put until rele_free()
+int rele_serialize(struct rectx *ctx, void *buf, int len);
+struct rectx *rele_load(const void *blob, int len, int *error);
+
+// A cache of compiled regexes keyed on the pattern and flags, so compiling
+// the same one again is just a lookup. Each caller gets its own ctx that
+// shares the compiled regex, see rele_cache_compile(), and rele_free() gives
+// it back.
+struct rele_cache_stats {
+    uint32_t    hits;
+    uint32_t    misses;
+    uint32_t    evictions;
+    uint32_t    entries;        // in the cache now
+    uint32_t    bytes;          // what they use
+};
+
+struct rectx *rele_cache_compile(char *regex, uint32_t flags, int *error);
+void rele_cache_limit(uint32_t bytes);
+void rele_cache_stats(struct rele_cache_stats *stats);
+void rele_cache_clear(void);
+
+// Graphviz DOT output of the compiled tree. Built with RELE_HEATMAP each node
+// also shows how the default state's matches used it (since the last
+// rele_heatmap_clear()). Only the task matcher counts, not RELE_NATIVE or the DFA.
 void rele_export_tree(struct rectx *ctx, const char *filename);
+void rele_heatmap_clear(struct rectx *ctx);
+int rele_export_c(struct rectx *ctx, const char *filename, const char *name);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../rele/rele.h"
+
+//
+// Generate a standalone matcher for a pattern, the output needs rele.h for
+// struct rele_match_t and the flags but nothing else from the library.
+//
+// ./gen match_date date.c '(\d{4})-(\d\d)-(\d\d)'
+//
+
+int main(int argc, char *argv[]) {
+	struct rectx *ctx;
+	int flags = 0;
+	int err = 0;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <function_name> <c_file_name> <regex> [caseless] [newline]\n", argv[0]);
+		exit(1);
+	}
+	for (int i = 4; i < argc; i++) {
+		if (strcmp(argv[i], "caseless") == 0) flags |= RELE_CASELESS;
+		else if (strcmp(argv[i], "newline") == 0) flags |= RELE_NEWLINE;
+		else {
+			fprintf(stderr, "Unknown flag: %s\n", argv[i]);
+			exit(1);
+		}
+	}
+	ctx = rele_compile(argv[3], flags, &err);
+	if (!ctx) {
+		fprintf(stderr, "Compilation failed (%d).\n", err);
+		exit(1);
+	}
+	if (!rele_export_c(ctx, argv[2], argv[1])) {
+		fprintf(stderr, "Can't generate code for this pattern.\n");
+		rele_free(ctx);
+		exit(1);
+	}
+	rele_free(ctx);
+	printf("done.\n");
+	exit(0);
+}
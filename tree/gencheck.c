@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../rele/rele.h"
+
+//
+// Check a matcher from gen against rele_match() for the same pattern, the
+// generated code has to be built in as gen_match().
+//
+// ./gen gen_match m.c 'a(b*)c' && cc -o check gencheck.c m.c rele.o && ./check 'a(b*)c' xabbc
+//
+
+extern const int gen_match_groups;
+int gen_match(const char *text, int len, int flags, struct rele_match_t *grp);
+
+int main(int argc, char *argv[]) {
+	struct rectx *ctx;
+	struct rele_match_t grp[64];
+	int flags = 0;
+	int err = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <regex> <text> [caseless] [newline]\n", argv[0]);
+		exit(1);
+	}
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "caseless") == 0) flags |= RELE_CASELESS;
+		else if (strcmp(argv[i], "newline") == 0) flags |= RELE_NEWLINE;
+		else {
+			fprintf(stderr, "Unknown flag: %s\n", argv[i]);
+			exit(1);
+		}
+	}
+	ctx = rele_compile(argv[1], flags, &err);
+	if (!ctx) {
+		fprintf(stderr, "Compilation failed (%d).\n", err);
+		exit(1);
+	}
+	if (gen_match_groups != rele_match_count(ctx) || gen_match_groups > 64) {
+		fprintf(stderr, "%s: group count differs\n", argv[1]);
+		exit(1);
+	}
+
+	int len = strlen(argv[2]);
+	int want = rele_match(ctx, argv[2], len, 0);
+	int got = gen_match(argv[2], len, 0, grp);
+	int bad = (want != got);
+
+	for (int i = 0; !bad && want == 1 && i < gen_match_groups; i++) {
+		struct rele_match_t *m = rele_get_match(ctx, i);
+		bad = (m->rm_so != grp[i].rm_so || m->rm_eo != grp[i].rm_eo);
+	}
+	if (bad) {
+		fprintf(stderr, "%s: rele_match() gave %d, the generated code %d\n", argv[1], want, got);
+		for (int i = 0; want == 1 && got == 1 && i < gen_match_groups; i++) {
+			struct rele_match_t *m = rele_get_match(ctx, i);
+			fprintf(stderr, "  %d: (%d,%d) (%d,%d)\n", i, m->rm_so, m->rm_eo, grp[i].rm_so, grp[i].rm_eo);
+		}
+		rele_free(ctx);
+		exit(1);
+	}
+	rele_free(ctx);
+	exit(0);
+}
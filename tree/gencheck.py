@@ -0,0 +1,104 @@
+#!/usr/bin/python3
+
+import os
+import re
+import sys
+import subprocess
+import tempfile
+
+#
+# Generate a standalone matcher (with gen) for each case in the test case
+# files that it can do, and check it finds the same as rele_match().
+#
+# gencheck.py <test file> [<test file> ...]
+#
+# CC and CFLAGS come from the environment, gencheck.o and rele.o need to
+# have been built already (make check does all of this).
+#
+
+CC = os.environ.get("CC", "gcc")
+CFLAGS = os.environ.get("CFLAGS", "-O2 -Wall").split()
+
+
+#
+# Pull out the pattern, text and flags for each case, anything with an
+# expected error, other flags or generated text is left out.
+#
+def read_cases(filename):
+    cases = []
+    case = {}
+    joiner = "\n"
+
+    with open(filename) as f:
+        for line in f.read().split("\n") + [""]:
+            line = line.rstrip()
+            if re.match('^\\s*#', line):
+                continue
+
+            if len(line) == 0:
+                if "name" in case and "regex" in case and "text" in case and not "skip" in case:
+                    cases.append(case)
+                case = {}
+                joiner = "\n"
+                continue
+
+            if line[:2] == "N:":
+                case["name"] = line[2:]
+            elif line[:1] == "/":
+                case["regex"] = line[1:]
+            elif line[:2] == "T:":
+                case["text"] = case["text"] + joiner + line[2:] if "text" in case else line[2:]
+            elif line == "J:NONE":
+                joiner = ""
+            elif line == "J:NL":
+                joiner = "\n"
+            elif line == "J:CR":
+                joiner = "\r"
+            elif line == "J:CRLF":
+                joiner = "\r\n"
+            elif line == "CF:CASELESS":
+                case.setdefault("flags", []).append("caseless")
+            elif line == "CF:NEWLINE":
+                case.setdefault("flags", []).append("newline")
+            elif line[:2] in ("E:", "CF", "GE"):
+                case["skip"] = 1
+    return cases
+
+
+if len(sys.argv) < 2:
+    print("Usage: " + sys.argv[0] + " <test file> [<test file> ...]")
+    sys.exit(1)
+
+checked = 0
+skipped = 0
+failed = 0
+
+with tempfile.TemporaryDirectory() as tmp:
+    src = os.path.join(tmp, "m.c")
+    check = os.path.join(tmp, "check")
+
+    for filename in sys.argv[1:]:
+        for case in read_cases(filename):
+            flags = case.get("flags", [])
+
+            # Patterns it can't do (backreferences) are fine, just not checked
+            gen = subprocess.run(["./gen", "gen_match", src, case["regex"]] + flags, capture_output=True)
+            if gen.returncode != 0:
+                skipped += 1
+                continue
+
+            cc = subprocess.run([CC] + CFLAGS + ["-I../rele", "-o", check, "gencheck.o", src, "rele.o"])
+            if cc.returncode != 0:
+                print("FAIL " + case["name"] + ": the generated code didn't build")
+                failed += 1
+                continue
+
+            run = subprocess.run([check, case["regex"], case["text"]] + flags)
+            if run.returncode != 0:
+                print("FAIL " + case["name"])
+                failed += 1
+                continue
+            checked += 1
+
+print("%d matched rele_match(), %d failed, %d skipped" % (checked, failed, skipped))
+sys.exit(1 if failed else 0)
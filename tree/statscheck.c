@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../rele/rele.h"
+
+//
+// Check what rele_get_stats() and rele_state_stats() report, and the heatmap
+// in rele_export_tree(), this needs rele.c built with RELE_STATS and
+// RELE_HEATMAP. The counts are what the task matcher does for each pattern,
+// so a change in how it walks the tree shows up here.
+//
+
+struct want {
+	char		*regex;
+	char		*text;
+	int			flags;
+	uint32_t	steps;
+	uint32_t	starts;
+};
+
+static const struct want wants[] = {
+	{ "a(b|c)d",	"xxacdx",		RELE_NO_DFA | RELE_NO_FASTSTART,	35, 5 },
+	{ "a(b|c)d",	"xxacdx",		RELE_NO_DFA,						19, 1 },
+	{ "(a*)+b",		"aaab",			RELE_NO_DFA,						87, 4 },
+	{ "x{2,3}y",	"xxxxy",		0,									67, 4 },
+};
+
+static int check(const char *what, const struct want *w, struct rele_stats *s, int kept) {
+	int ok = kept && s->steps == w->steps && s->starts == w->starts &&
+				s->nodes > 0 && s->node_bytes > 0 && s->state_bytes > 0 &&
+				s->size >= s->node_bytes + s->state_bytes;
+
+	if (!ok) {
+		fprintf(stderr, "%s %s: kept %d steps %u (want %u) starts %u (want %u) nodes %u node_bytes %u state_bytes %u size %u\n",
+				what, w->regex, kept, s->steps, w->steps, s->starts, w->starts, s->nodes, s->node_bytes,
+				s->state_bytes, s->size);
+	}
+	return ok;
+}
+
+// Add up the visits in the tree output, every node is in it once
+static long heat_visits(struct rectx *ctx) {
+	const char *name = "statscheck.dot";
+	char line[256];
+	long total = 0;
+	unsigned v;
+
+	rele_export_tree(ctx, name);
+	FILE *f = fopen(name, "r");
+	if (!f) return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "visits=%u", &v) == 1) total += v;
+	}
+	fclose(f);
+	remove(name);
+	return total;
+}
+
+// Only the default state counts towards the heatmap, it adds up over matches
+// until it's cleared
+static int check_heat(const struct want *w) {
+	struct rele_stats s;
+	int err = 0;
+	int ok = 0;
+
+	struct rectx *ctx = rele_compile(w->regex, w->flags, &err);
+	if (!ctx) return 0;
+	if (rele_match(ctx, w->text, 0, 0) == 1 && rele_get_stats(ctx, &s)) {
+		long once = heat_visits(ctx);
+		rele_match(ctx, w->text, 0, 0);
+		long twice = heat_visits(ctx);
+		rele_heatmap_clear(ctx);
+		long cleared = heat_visits(ctx);
+
+		ok = (once == s.steps && twice == 2 * once && cleared == 0);
+		if (!ok) fprintf(stderr, "heatmap %s: visits %ld, %ld then %ld (steps %u)\n", w->regex, once, twice, cleared, s.steps);
+	}
+	rele_free(ctx);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	int failed = 0;
+
+	for (int i = 0; i < (int)(sizeof(wants) / sizeof(wants[0])); i++) {
+		const struct want *w = &wants[i];
+		struct rele_stats s;
+		int err = 0;
+
+		struct rectx *ctx = rele_compile(w->regex, w->flags, &err);
+		if (!ctx) {
+			fprintf(stderr, "%s: compilation failed (%d).\n", w->regex, err);
+			failed++;
+			continue;
+		}
+
+		// The default state, then one of our own has to count the same
+		if (rele_match(ctx, w->text, 0, 0) != 1) failed++;
+		else if (!check("rele_get_stats", w, &s, rele_get_stats(ctx, &s))) failed++;
+
+		struct rematch *m = rele_state_new(ctx);
+		if (!m || rele_exec(m, w->text, 0, 0) != 1) failed++;
+		else if (!check("rele_state_stats", w, &s, rele_state_stats(m, &s))) failed++;
+
+		if (m) rele_state_free(m);
+		rele_free(ctx);
+
+		if (!check_heat(w)) failed++;
+	}
+	printf("stats: %d failed\n", failed);
+	exit(failed ? 1 : 0);
+}